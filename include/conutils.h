@@ -37,6 +37,8 @@
  *
  * @note This library does not implement any kind of thread synchronization.
  *       If used in a multi-threaded program be sure to implement synchronization yourself.
+ *       The only exception is the optional screen render thread, which synchronizes
+ *       with the thread rendering the surface tree internally.
  *
  * @section install_sec Compile and install
  *
@@ -103,12 +105,31 @@
  *         to render it's child surfaces. Make content changes only to leaf node surfaces in the tree.
  * * @link conutils::Screen Screen @endlink\n
  *   The screen is a special type of surface that renders it's contents to the terminal screen.
- *   This will be the top surface in a surface tree. The screen is a singleton class.
+ *   This will be the top surface in a surface tree. The terminal screen is a singleton class.
+ *   Screens of a fixed size that write to any file descriptor or to memory can be created
+ *   for capturing and measuring rendering without a terminal.
  * * @link conutils::Keyboard Keyboard @endlink\n
  *   This is the class that will fetch your keystrokes. Please note that some terminals
  *   send wicked escape sequences for the special keys and some may not work. I'm looking forward
  *   to minimize all of those. The keyboard is a singleton class.
  *
+ * Programs serving many terminals, e.g. pseudo terminals of remote sessions, can create
+ * a Screen and a Keyboard per terminal file descriptor. Their frames can be encoded by a
+ * shared @link conutils::RenderPool RenderPool @endlink and written by a shared
+ * @link conutils::AsyncWriter AsyncWriter @endlink from a single event loop.
+ * Terminals watching the same content are served by mirroring one screen to them
+ * with addMirror(). Its frames are encoded once and slow viewers do not hold up the rest.
+ *
+ * Committed frames can be recorded to a file with a @link conutils::Recorder Recorder @endlink
+ * and inspected later, frame by frame or from any point in time, with a
+ * @link conutils::Recording Recording @endlink.
+ * A @link conutils::Replay Replay @endlink plays them, or captured terminal output,
+ * back through a screen.
+ *
+ * Other processes can watch the screen contents without a terminal after
+ * Screen::exportFramebuffer() by mapping them with a
+ * @link conutils::FramebufferReader FramebufferReader @endlink.
+ *
  * Here are some short examples to get you started:\n
  *
  * @code{.cpp}
@@ -161,10 +182,17 @@
 #include <termios.h>
 #include <poll.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <map>
 #include <set>
+#include <vector>
 
 namespace conutils {
 
@@ -491,6 +519,13 @@ public:
     std::string           str(std::string ident = "") const;
 
 protected:
+    /**
+     * Called when render() is about to composite layers onto this surface.
+     *
+     * @param dirty : The region that is going to be updated in this surface.
+     */
+    virtual void          renderBegin(const Rect& dirty) { }
+
     /**
      * Called when render() of this surface is complete.
      *
@@ -501,6 +536,23 @@ protected:
      */
     virtual void          renderDone(const Rect& dirty) { }
 
+    /**
+     * Reports how long the render() chain in progress spent so far on collecting
+     * dirty regions and on compositing layers. Meant to be called from renderDone().
+     *
+     * @param collect_ns : Nanoseconds spent collecting dirty regions.
+     * @param compose_ns : Nanoseconds spent compositing.
+     */
+    void                  renderTimes(int64_t& collect_ns, int64_t& compose_ns) const;
+
+    /**
+     * Moves the contents of the surface to memory provided by the caller.
+     *
+     * @param data    : Memory for size() characters.
+     * @param release : Called with data once the surface stops using it.
+     */
+    void                  setBuffer(Char *data, std::function<void (Char *)> release);
+
 private:
     /* Disallow suface copying. */
     Surface(const Surface&);
@@ -512,21 +564,793 @@ private:
     Point mPos;
     bool mVisible = true;
     Surface *mParent = nullptr;
-    std::unique_ptr<Char> mData = nullptr;
+    std::unique_ptr<Char, std::function<void (Char *)>> mData;
     std::map<int /*Z*/, std::set<Surface *>> mLayerMap;
 };
 
+/**
+ * Batches terminal writes of many screens and completes them asynchronously.
+ * Writes are only queued by write(). process() submits everything queued in a
+ * single batch and calls the completion callbacks. Uses io_uring when the kernel
+ * provides it and falls back to non-blocking write() and poll() otherwise.
+ *
+ * @note Destroying the writer abandons queued writes without calling their callbacks.
+ */
+class AsyncWriter {
+public:
+    /**
+     * Called from process() when a write is complete.
+     * The argument is the number of bytes written or < 0 on error.
+     */
+    typedef std::function<void(ssize_t)> Callback;
+
+    /** Cumulative writer statistics. */
+    struct Stats {
+        /** Number of completed writes. */
+        size_t writes = 0;
+        /** Number of bytes written. */
+        size_t bytes = 0;
+        /** Number of system calls issued, io_uring_enter(), write() and poll() alike. */
+        size_t syscalls = 0;
+    };
+
+    /**
+     * @param entries   : Maximum number of writes in a single io_uring submission.
+     * @param io_uring  : Use io_uring if available. Set to false to force the fallback.
+     */
+    AsyncWriter(unsigned entries = 256, bool io_uring = true);
+    ~AsyncWriter();
+
+    /** @return true if io_uring is used, false if the poll() and write() fallback is. */
+    inline bool    ioUring() const { return mRing != nullptr; }
+
+    /**
+     * Queues a write. It is submitted by the next process().
+     * Partial writes are continued and writes that would block are retried once
+     * the file descriptor is writable, so the callback sees all bytes or an error.
+     *
+     * @param fd   : File descriptor to write to. Should be non-blocking.
+     * @param data : Data to write. Must stay valid until the callback is called.
+     * @param len  : Number of bytes to write.
+     * @param done : Completion callback.
+     *
+     * @return 0 on success, -EBUSY if a write to fd is already queued, other < 0 on error.
+     */
+    int            write(int fd, const void *data, size_t len, Callback done);
+
+    /**
+     * Submits the queued writes, waits for completions and calls their callbacks.
+     * Writes queued by the callbacks are submitted before returning.
+     *
+     * @param timeout_ms : Maximum time to wait for a completion. -1 == wait indefinitely.
+     *
+     * @return Number of completed writes, < 0 on error.
+     */
+    int            process(int timeout_ms = 0);
+
+    /** @return Number of writes that did not complete yet. */
+    inline size_t  inFlight() const { return mFds.size(); }
+
+    /** @return Cumulative statistics. */
+    inline const Stats& stats() const { return mStats; }
+
+private:
+    /* Disallow writer copying. */
+    AsyncWriter(const AsyncWriter&);
+    const AsyncWriter& operator= (const AsyncWriter&);
+
+    struct Request {
+        int fd;
+        const char *data;
+        size_t len;
+        size_t done;
+        ssize_t result;
+        /* Wait for the fd to be writable before writing again. */
+        bool poll;
+        Callback callback;
+    };
+    struct Ring;
+
+    void complete(Request *req, ssize_t result);
+    void writeOnce(Request *req);
+    int submit();
+    int wait(int timeout_ms);
+
+    std::unique_ptr<Ring> mRing;
+    /* Writes not submitted yet. With the fallback also the ones waiting for poll(). */
+    std::deque<Request *> mQueue;
+    /* Completed writes whose callbacks are not called yet. */
+    std::vector<Request *> mDone;
+    std::vector<std::unique_ptr<Request>> mRequests;
+    std::vector<Request *> mFree;
+    std::vector<struct pollfd> mPollFds;
+    /* File descriptors with a write that did not complete yet. */
+    std::set<int> mFds;
+    Stats mStats;
+};
+
+class Screen;
+
+/**
+ * Threads encoding and writing frames for many screens.
+ * Screens join with Screen::startRenderThread() and leave with Screen::stopRenderThread(),
+ * which must happen before the pool is destroyed. A screen is encoded by one
+ * thread at a time and only when it has a new snapshot or commands.
+ */
+class RenderPool {
+public:
+    /** @param threads : Number of threads. 0 for one per CPU. */
+    RenderPool(unsigned threads = 0);
+    ~RenderPool();
+
+    /** @return Number of threads. */
+    inline size_t  threads() const { return mThreads.size(); }
+
+private:
+    friend class Screen;
+
+    /* Disallow pool copying. */
+    RenderPool(const RenderPool&);
+    const RenderPool& operator= (const RenderPool&);
+
+    int add(Screen *sc, int event_fd);
+    void remove(Screen *sc, int event_fd);
+    void worker();
+
+    int mEpollFd = -1;
+    int mStopFd = -1;
+    std::vector<std::thread> mThreads;
+    std::mutex mLock;
+    std::condition_variable mIdle;
+    std::set<Screen *> mScreens;
+};
+
+/**
+ * Records committed frames to a file as cell deltas against the previous frame.
+ * Every keyframe interval and whenever the size changes a full frame is stored instead.
+ * Frames are read back with Recording. Attach it to a screen with Screen::setRecorder().
+ *
+ * The file starts with a header followed by a record per frame. Cells are stored
+ * as spans of changed cells, coded as runs of glyphs sharing an attribute. Closing
+ * the recorder appends an index of the keyframes, which Recording rebuilds by
+ * scanning the records of a file that was not closed.
+ */
+class Recorder {
+public:
+    /** Cumulative recording statistics. */
+    struct Stats {
+        /** Number of recorded frames. */
+        size_t frames = 0;
+        /** Number of keyframes among them. */
+        size_t keyframes = 0;
+        /** Number of cells stored. */
+        size_t cells = 0;
+        /** Number of bytes written to the file. */
+        size_t bytes = 0;
+        /** Nanoseconds spent recording frames, writing the file included. */
+        int64_t record_ns = 0;
+    };
+
+    /**
+     * @param keyframe_interval : Number of frames between keyframes. 0 stores only
+     *                            the first frame and frames of a new size as keyframes.
+     */
+    Recorder(unsigned keyframe_interval = 300);
+    ~Recorder();
+
+    /**
+     * Starts recording to a new file. A recording in progress is closed first.
+     *
+     * @return 0 on success, < 0 on error.
+     */
+    int            open(const char *path);
+
+    /**
+     * Writes the buffered frames and the keyframe index and closes the file.
+     *
+     * @return 0 on success, < 0 on error, e.g. the first error of a previous frame().
+     */
+    int            close();
+
+    /**
+     * Records a frame.
+     *
+     * @param data   : Cells of the frame.
+     * @param bounds : Size of the frame.
+     * @param dirty  : Region that may differ from the previous frame.
+     *
+     * @return 0 on success, < 0 on error. Further frames are not recorded after an error.
+     */
+    int            frame(const Char *data, const Rect& bounds, const Rect& dirty);
+
+    /** @return true if a file is open. */
+    inline bool    recording() const { return mFd >= 0; }
+
+    /** @return Cumulative statistics. */
+    inline const Stats& stats() const { return mStats; }
+
+private:
+    /* Disallow recorder copying. */
+    Recorder(const Recorder&);
+    const Recorder& operator= (const Recorder&);
+
+    struct IndexEntry {
+        uint64_t frame;
+        int64_t time;
+        uint64_t offset;
+    };
+
+    int write(bool all);
+
+    int mFd = -1;
+    int mError = 0;
+    unsigned mKeyframeInterval;
+    int64_t mStart = 0;
+    unsigned mSinceKeyframe = 0;
+    /* Bytes of the file before the buffer. */
+    uint64_t mOffset = 0;
+    std::string mBuf;
+    std::vector<Char> mPrev;
+    Rect mPrevBounds;
+    std::vector<IndexEntry> mIndex;
+    Stats mStats;
+};
+
+/**
+ * Reads frames stored by a Recorder.
+ */
+class Recording {
+public:
+    Recording() { }
+    ~Recording();
+
+    /**
+     * Opens a recording. Files that were not closed are read up to their last complete frame.
+     *
+     * @return 0 on success, -EINVAL if it is not a recording, other < 0 on error.
+     */
+    int            open(const char *path);
+
+    /** Closes the recording. */
+    void           close();
+
+    /**
+     * Decodes the next frame.
+     *
+     * @return 1 if a frame was decoded, 0 at the end of the recording, < 0 on error.
+     */
+    int            next();
+
+    /**
+     * Moves to a frame. The following next() decodes it.
+     * Decodes from the keyframe before it.
+     *
+     * @return 0 on success, -ERANGE if there is no such frame, other < 0 on error.
+     */
+    int            seek(size_t frame);
+
+    /**
+     * Moves to the last frame recorded at or before a time. The following next() decodes it.
+     *
+     * @param time_us : Microseconds since the recording started.
+     *
+     * @return 0 on success, -ERANGE if the time is before the first frame, other < 0 on error.
+     */
+    int            seekTime(int64_t time_us);
+
+    /** @return Number of frames. */
+    inline size_t  frames() const { return mFrames; }
+    /** @return Number of keyframes. */
+    inline size_t  keyframes() const { return mIndex.size(); }
+    /** @return Wall clock time the recording started in microseconds since the epoch. */
+    inline int64_t startTime() const { return mStartTime; }
+
+    /** @return Number of the frame the last next() decoded. -1 if it decoded none since open() or the last seek. */
+    inline ssize_t position() const { return mPosition; }
+    /** @return Cells of the decoded frame. */
+    inline const Char *data() const { return mData.data(); }
+    /** @return Size of the decoded frame. */
+    inline const Rect& bounds() const { return mBounds; }
+    /** @return Region of the decoded frame that differs from the previous one. Whole bounds for keyframes. */
+    inline const Rect& dirty() const { return mDirty; }
+    /** @return Microseconds from the start of the recording to the decoded frame. */
+    inline int64_t time() const { return mTime; }
+    /** @return Number of bytes the decoded frame took in the file. */
+    inline size_t  frameBytes() const { return mFrameBytes; }
+
+private:
+    /* Disallow recording copying. */
+    Recording(const Recording&);
+    const Recording& operator= (const Recording&);
+
+    struct IndexEntry {
+        uint64_t frame;
+        int64_t time;
+        uint64_t offset;
+    };
+
+    int scan();
+    int decode();
+
+    const uint8_t *mMap = nullptr;
+    size_t mSize = 0;
+    size_t mPos = 0;
+    /* End of the frame records. */
+    size_t mEnd = 0;
+    size_t mFrames = 0;
+    /* Next frame to decode. */
+    size_t mFrame = 0;
+    ssize_t mPosition = -1;
+    int64_t mStartTime = 0;
+    std::vector<IndexEntry> mIndex;
+    std::vector<Char> mData;
+    Rect mBounds;
+    Rect mDirty;
+    int64_t mTime = 0;
+    size_t mFrameBytes = 0;
+};
+
+/**
+ * Serves the frames of a screen to remote viewers as cell deltas over stream sockets.
+ * Attach it with Screen::setStreamServer(). The messages are the frame records of
+ * recordings, so a viewer needs no terminal of the kind the screen has.
+ *
+ * New clients start with a keyframe. A client that has not taken all of the previous
+ * message when a frame is committed skips that frame. Its damage is merged and sent
+ * as a single delta once it drained, so slow links do not hold up the screen or other
+ * clients. Writes never block. Poll clientFds() for POLLOUT and call flush().
+ */
+class StreamServer {
+public:
+    /** Statistics of a client connection. */
+    struct Stats {
+        /** Number of frames sent. */
+        size_t frames = 0;
+        /** Number of keyframes among them. */
+        size_t keyframes = 0;
+        /** Number of frames merged into a later one because the client was busy. */
+        size_t merged = 0;
+        /** Number of cells sent. */
+        size_t cells = 0;
+        /** Number of bytes written. */
+        size_t bytes = 0;
+        /** Microseconds since the client connected. */
+        int64_t connected_us = 0;
+
+        /** @return Average bytes per second since the client connected. */
+        inline double rate() const { return connected_us ? bytes * 1e6 / connected_us : 0; }
+    };
+
+    StreamServer();
+    ~StreamServer();
+
+    /**
+     * Listens for clients on a Unix domain socket. Poll the returned descriptor for
+     * POLLIN and call accept().
+     *
+     * @param path : Socket path. An existing socket file is replaced.
+     *
+     * @return Listening socket on success, < 0 on error.
+     */
+    int            listen(const char *path);
+
+    /**
+     * Accepts a pending connection on the listening socket and adds it as a client.
+     *
+     * @return The client descriptor on success, -EAGAIN if none is pending, other < 0 on error.
+     */
+    int            accept();
+
+    /**
+     * Adds a client, e.g. one end of a socketpair. It is set to non-blocking mode
+     * and closed when the client is removed.
+     *
+     * @return 0 on success, -EEXIST if already added, other < 0 on error.
+     */
+    int            addClient(int fd);
+
+    /**
+     * Removes and closes a client.
+     *
+     * @return 0 on success, -ENOENT if fd is not a client.
+     */
+    int            removeClient(int fd);
+
+    /** @return Number of clients. */
+    inline size_t  clients() const { return mClients.size(); }
+
+    /** @return Descriptors of the clients with data waiting for them. */
+    std::vector<int> clientFds() const;
+
+    /**
+     * Gets the statistics of a client.
+     *
+     * @return 0 on success, -ENOENT if fd is not a client.
+     */
+    int            clientStats(int fd, Stats& stats) const;
+
+    /**
+     * Sends a frame to the clients that took all previous data and merges it for the rest.
+     *
+     * @param data   : Cells of the frame.
+     * @param bounds : Size of the frame.
+     * @param dirty  : Region that may differ from the previous frame.
+     */
+    void           frame(const Char *data, const Rect& bounds, const Rect& dirty);
+
+    /**
+     * Writes waiting data and sends merged damage to clients that drained.
+     * Clients whose connection failed are removed.
+     *
+     * @return Number of clients removed.
+     */
+    int            flush();
+
+private:
+    /* Disallow server copying. */
+    StreamServer(const StreamServer&);
+    const StreamServer& operator= (const StreamServer&);
+
+    struct Client {
+        int fd;
+        std::string out;
+        size_t pos = 0;
+        int error = 0;
+        bool keyframe = true;
+        /* What the client has once it took out. */
+        std::vector<Char> sent;
+        Rect sentBounds;
+        /* Region changed since the last message. */
+        Rect damage;
+        int64_t connected;
+        Stats stats;
+    };
+
+    void send(Client& c);
+    void write(Client& c);
+
+    int mListenFd = -1;
+    std::string mPath;
+    int64_t mStart;
+    std::vector<Char> mFrame;
+    Rect mBounds;
+    std::vector<std::unique_ptr<Client>> mClients;
+};
+
+/**
+ * Shows the frames of a StreamServer on a local screen.
+ * Frames are drawn into a layer covering the screen. Larger ones are cropped.
+ */
+class StreamClient {
+public:
+    /** Cumulative client statistics. */
+    struct Stats {
+        /** Number of frames received. */
+        size_t frames = 0;
+        /** Number of keyframes among them. */
+        size_t keyframes = 0;
+        /** Number of bytes received. */
+        size_t bytes = 0;
+        /** Number of renders of the screen. Frames received together are rendered once. */
+        size_t renders = 0;
+    };
+
+    StreamClient(Screen *screen);
+    ~StreamClient();
+
+    /**
+     * Connects to a server listening on a Unix domain socket.
+     *
+     * @return 0 on success, < 0 on error.
+     */
+    int            connect(const char *path);
+
+    /**
+     * Uses a connected socket, e.g. one end of a socketpair. It is set to non-blocking
+     * mode and closed by the client.
+     *
+     * @return 0 on success, < 0 on error.
+     */
+    int            attach(int fd);
+
+    /** @return The socket. Poll it for POLLIN and call process(). */
+    inline int     fd() const { return mFd; }
+
+    /**
+     * Reads what the server sent, applies the frames and renders the screen once.
+     *
+     * @return Number of frames applied, -EPIPE once the server closed the
+     *         connection, other < 0 on error.
+     */
+    int            process();
+
+    /** @return Cumulative statistics. */
+    inline const Stats& stats() const { return mStats; }
+
+private:
+    /* Disallow client copying. */
+    StreamClient(const StreamClient&);
+    const StreamClient& operator= (const StreamClient&);
+
+    Screen *mScreen;
+    Surface mSurface;
+    int mFd = -1;
+    bool mEof = false;
+    std::string mIn;
+    std::vector<Char> mCells;
+    Rect mBounds;
+    Stats mStats;
+};
+
+/**
+ * Header of a screen exported to shared memory with Screen::exportFramebuffer().
+ * The cells follow at offset, width * height of them row by row.
+ *
+ * The fields and cells are guarded by a sequence lock: seq is odd while the screen
+ * updates them. A reader reads seq, waits for it to be even, reads what it needs and
+ * retries if seq changed meanwhile. FramebufferReader does that.
+ */
+struct FramebufferHeader {
+    /** "conufb1" */
+    char magic[8];
+    /** Odd while the frame is updated. */
+    std::atomic<uint64_t> seq;
+    /** Number of frames rendered since the export started. */
+    uint64_t generation;
+    /** Bytes of the segment. Remap if larger than the mapping, it never shrinks. */
+    uint64_t size;
+    /** Offset of the cells from the start of the segment. */
+    uint32_t offset;
+    /** Bytes per cell, sizeof(Char). */
+    uint32_t cell_size;
+    /** Screen width. */
+    uint32_t width;
+    /** Screen height. */
+    uint32_t height;
+    /** Region updated by the last frame. */
+    int32_t dirty_left;
+    int32_t dirty_top;
+    int32_t dirty_right;
+    int32_t dirty_bottom;
+};
+
+/**
+ * Reads a screen exported to shared memory from another process without copying it.
+ *
+ * @code{.cpp}
+ * uint64_t seq;
+ *
+ * do {
+ *     if (reader.begin(seq))
+ *         break;
+ *     // Read reader.data(), reader.width() and others.
+ * } while (reader.retry(seq));
+ * @endcode
+ */
+class FramebufferReader {
+public:
+    FramebufferReader() { }
+    ~FramebufferReader();
+
+    /**
+     * Maps a named export.
+     *
+     * @return 0 on success, -EINVAL if it is not an exported screen, other < 0 on error.
+     */
+    int            open(const char *name);
+
+    /**
+     * Maps an export by file descriptor, e.g. one passed over a Unix socket.
+     * The descriptor is not closed by the reader.
+     *
+     * @return 0 on success, -EINVAL if it is not an exported screen, other < 0 on error.
+     */
+    int            open(int fd);
+
+    /** Unmaps the export. */
+    void           close();
+
+    /**
+     * Waits until the screen is not updating the frame and takes a snapshot of its
+     * size, generation and dirty region, which the accessors return until the next
+     * begin(). Remaps the segment if the screen grew.
+     *
+     * @param seq        : Set to the sequence to pass to retry().
+     * @param timeout_ms : How long to wait for an update to finish. -1 == wait indefinitely.
+     *
+     * @return 0 on success, -ETIMEDOUT if the screen did not finish updating in time,
+     *         -EINVAL if the header describes cells outside the segment, other < 0 if
+     *         remapping failed. Do not read the frame then.
+     */
+    int            begin(uint64_t& seq, int timeout_ms = 1000);
+
+    /** @return true if the frame changed since begin() and what was read must be read again. */
+    bool           retry(uint64_t seq) const;
+
+    /** @return Screen width at begin(). */
+    inline size_t  width() const { return mWidth; }
+    /** @return Screen height at begin(). */
+    inline size_t  height() const { return mHeight; }
+    /** @return Number of frames rendered since the export started, at begin(). */
+    inline uint64_t generation() const { return mGeneration; }
+    /** @return Region updated by the last frame before begin(). */
+    inline const Rect& dirty() const { return mDirty; }
+    /** @return The cells, width() * height() of them. NULL before the first begin(). */
+    inline const Char *data() const { return mCells; }
+
+private:
+    /* Disallow reader copying. */
+    FramebufferReader(const FramebufferReader&);
+    const FramebufferReader& operator= (const FramebufferReader&);
+
+    int map(size_t size);
+
+    int mFd = -1;
+    FramebufferHeader *mHeader = nullptr;
+    size_t mSize = 0;
+    /* Snapshot of the header taken by begin(). */
+    size_t mWidth = 0;
+    size_t mHeight = 0;
+    uint64_t mGeneration = 0;
+    Rect mDirty;
+    const Char *mCells = nullptr;
+};
+
 /**
  * Singleton class representing the terminal screen.
  * It is responsible for displaying actual characters on the screen.
+ * Headless screens writing elsewhere can be made with createHeadless(),
+ * screens of other terminals with create().
  */
 class Screen : private Surface {
 public:
+    /** Optional terminal features the screen may use to reduce output. */
+    enum {
+        CAP_REP            = 0x01, /**< Repeat preceding character (CSI n b). */
+        CAP_ERASE          = 0x02, /**< ECH and EL erase with the current background color. */
+        CAP_SCROLL         = 0x04, /**< Scrolling regions (DECSTBM) with SU and SD. */
+        CAP_SYNC           = 0x08, /**< Synchronized output (DEC private mode 2026). */
+        CAP_TRUECOLOR      = 0x10, /**< 24 bit colors. Detected only, colors are palette indexes. */
+        CAP_KITTY_KEYS     = 0x20, /**< Kitty keyboard protocol. Detected only. */
+        CAP_SGR_MOUSE      = 0x40, /**< SGR mouse reporting (DEC private mode 1006). Detected only. */
+    };
+
+    /** Terminal families the encoder is specialized for. */
+    enum Encoder {
+        ENCODER_XTERM,  /**< xterm and compatible terminals with 256 colors. */
+        ENCODER_LINUX,  /**< Linux console. 16 colors, only CAP_ERASE is used. */
+        ENCODER_VT100,  /**< VT100. No colors and no CAP_* features are used. */
+    };
+
+    /** Terminal identity and features found by probeCapabilities(). */
+    struct Profile {
+        /** OR'ed values of CAP_* flags the terminal supports. */
+        uint32_t caps = 0;
+        /** Conformance level from primary device attributes, e.g. 62 for VT220. 0 if unknown. */
+        int level = 0;
+        /** Terminal type from secondary device attributes. -1 if unknown. */
+        int type = -1;
+        /** Terminal version from secondary device attributes. -1 if unknown. */
+        int version = -1;
+        /** Terminal name reported by XTGETTCAP. Empty if unknown. */
+        std::string name;
+    };
+
+    /**
+     * Terminal output statistics of a single committed frame.
+     * In non-blocking mode writes that drain the frame later are counted too.
+     */
+    struct FrameStats {
+        /** Number of bytes written to the terminal. */
+        size_t bytes = 0;
+        /** Number of write() system calls issued. */
+        size_t syscalls = 0;
+        /** Number of renders whose damage was combined into this frame. */
+        size_t renders = 0;
+        /** Microseconds from the first render of this frame until it was written. */
+        int64_t latency_us = 0;
+        /** Microseconds since the previous committed frame. 0 for the first one. */
+        int64_t interval_us = 0;
+        /** Number of cells compared with the previous frame. */
+        size_t cells_scanned = 0;
+        /** Number of cells updated on the terminal. */
+        size_t cells_emitted = 0;
+        /** Bytes of drawn characters. */
+        size_t glyph_bytes = 0;
+        /** Bytes of escape sequences and cursor movement, including characters printed again to move the cursor. */
+        size_t escape_bytes = 0;
+        /** Number of attribute changes. */
+        size_t attr_changes = 0;
+        /** Number of cursor moves. */
+        size_t cursor_moves = 0;
+        /** Nanoseconds the renders of this frame spent collecting dirty regions of the surface tree. */
+        int64_t collect_ns = 0;
+        /** Nanoseconds the renders of this frame spent compositing the surface tree. */
+        int64_t compose_ns = 0;
+        /** Nanoseconds spent encoding the frame. */
+        int64_t encode_ns = 0;
+        /** Nanoseconds spent in write() system calls. */
+        int64_t write_ns = 0;
+        /** Nanoseconds spent recording the frame. */
+        int64_t record_ns = 0;
+    };
+
+    /** Number of most recent frames frameTimePercentile() and frameTimeHistogram() cover. */
+    static const size_t FRAME_WINDOW = 1024;
+
+    /** Cumulative statistics of non-blocking output and frame pacing. */
+    struct BackpressureStats {
+        /** Frames committed to the terminal. */
+        size_t frames = 0;
+        /** Renders whose damage was merged into the pending frame because the terminal was busy. */
+        size_t merged = 0;
+        /** Renders that were never displayed on their own because later damage was merged in. */
+        size_t dropped = 0;
+        /** Times the terminal could not take the whole frame. */
+        size_t stalls = 0;
+    };
+
+    /** Adaptive quality levels. Each level degrades further than the one before. */
+    enum {
+        ADAPT_FULL         = 0, /**< Full quality. */
+        ADAPT_20_FPS       = 1, /**< At most 20 frames per second. */
+        ADAPT_16_COLORS    = 2, /**< 20 frames per second in the 16 ANSI colors. */
+        ADAPT_MONO         = 3, /**< 10 frames per second without colors. */
+        ADAPT_PRIORITY     = 4, /**< 10 frames per second of the priority layers. Everything else once a second. */
+    };
+
+    /** Measurements and decisions of adaptive quality. */
+    struct AdaptiveStats {
+        /** Current ADAPT_* level. */
+        unsigned level = ADAPT_FULL;
+        /** Frame rate limit of the level. 0 if not limited. */
+        unsigned fps = 0;
+        /** Colors shown at the level. 256, 16 or 0. */
+        unsigned colors = 256;
+        /** Bytes per second the terminal takes. Measured while it has a backlog, else the highest rate seen. */
+        double drain_rate = 0;
+        /** Output waiting for the terminal in our buffer and its queue. */
+        size_t backlog = 0;
+        /** Milliseconds it takes the terminal to take the backlog. -1 if it took nothing. */
+        double backlog_ms = 0;
+        /** Times the level was raised because the backlog exceeded the target. */
+        size_t degrades = 0;
+        /** Times the level was lowered because the backlog stayed small. */
+        size_t restores = 0;
+        /** Frames that held back damage outside the priority layers. */
+        size_t held = 0;
+    };
+
     ~Screen();
 
     /** @return Pointer to the screen instance. NULL if something went wrong. */
     static Screen *getInstance();
 
+    /**
+     * Creates a screen of a fixed size that is not bound to the terminal.
+     * Its output goes to fd, which can be a pipe, a file or a pseudo terminal,
+     * or to memory if fd < 0. Useful for capturing and measuring rendering
+     * without a terminal.
+     *
+     * @param width  : Screen width.
+     * @param height : Screen height.
+     * @param fd     : File descriptor to write to. Not closed by the screen. < 0 for memory.
+     *
+     * @return The new screen. NULL if something went wrong.
+     */
+    static std::unique_ptr<Screen> createHeadless(size_t width, size_t height, int fd = -1);
+
+    /**
+     * Creates a screen for the terminal on fd, e.g. a pseudo terminal of a session.
+     * The size is queried from the terminal and its replies are read from fd.
+     *
+     * @param fd   : Terminal file descriptor. Not closed by the screen.
+     * @param term : Terminal type of the session for the profile cache. NULL for $TERM.
+     *
+     * @return The new screen. NULL if something went wrong.
+     */
+    static std::unique_ptr<Screen> create(int fd, const char *term = nullptr);
+
     /** @return Screen width */
     inline size_t  width() const { return Surface::width(); }
     /** @return Screen height */
@@ -543,6 +1367,21 @@ public:
      */
     int            resize();
 
+    /**
+     * Resize the screen to the given dimensions.
+     *
+     * @return 0 on success, < 0 on error. If only remapping the exported framebuffer
+     *         failed the screen is resized but the export keeps showing the last frame.
+     */
+    int            resize(size_t width, size_t height);
+
+    /**
+     * Takes the output a memory backed screen wrote since the last call.
+     *
+     * @return The output. Always empty if the screen writes to a file descriptor.
+     */
+    std::string    takeOutput();
+
     /**
      * Waits indefinitely for SIGWINCH signal. (Window size changed)
      *
@@ -552,6 +1391,17 @@ public:
      */
     int            wait_sigwinch(Rect& new_bounds);
 
+    /**
+     * Checks whether the terminal size differs from the screen size.
+     * SIGWINCH can not tell terminals apart, so screens from create(int fd)
+     * call this instead when the size of their terminal might have changed.
+     *
+     * @param new_bounds : Will be filled with the new bounds if they changed.
+     *
+     * @return 1 if the size changed, 0 if not, < 0 on error.
+     */
+    int            sizeChanged(Rect& new_bounds);
+
     /**
      * Makes another surface as a layer of this one.
      *
@@ -616,20 +1466,612 @@ public:
     /** @return Visibility of the cursor. */
     inline bool    cursorVisible() const { return mCursorVisible; }
 
+    /** @return Output statistics of the last committed frame. A copy, the render thread may be updating them. */
+    FrameStats     frameStats() const;
+
+    /**
+     * Frame time is the sum of the collect, compose, encode and write times of a frame.
+     *
+     * @param p : Percentile from 0 to 100.
+     *
+     * @return Frame time percentile of the last FRAME_WINDOW frames in nanoseconds.
+     *         0 if no frame was committed yet.
+     */
+    int64_t        frameTimePercentile(double p) const;
+
+    /**
+     * @return Histogram of the frame times of the last FRAME_WINDOW frames.
+     *         Element n counts the frames that took from 2^n to 2^(n+1) - 1 nanoseconds.
+     */
+    std::vector<size_t> frameTimeHistogram() const;
+
+    /**
+     * Sets the optional terminal features that the screen is allowed to use.
+     * Only enable features the terminal supports. None are enabled by default.
+     *
+     * @param caps : OR'ed values of CAP_* flags.
+     */
+    inline void    setCapabilities(uint32_t caps) { mCaps.store(caps); }
+
+    /** @return OR'ed values of enabled CAP_* flags. */
+    inline uint32_t capabilities() const { return mCaps; }
+
+    /**
+     * Selects the encoder specialized for a terminal family. Screens pick it from the
+     * terminal type when created, headless ones use ENCODER_XTERM. Enabled capabilities
+     * the family does not have are not used.
+     *
+     * @param encoder : Terminal family.
+     *
+     * @return 0 on success, -EINVAL if encoder is unknown.
+     */
+    int            setEncoder(Encoder encoder);
+
+    /** @return Terminal family the encoder is specialized for. */
+    inline Encoder encoder() const { return mEncoder; }
+
+    /**
+     * Enables or disables non-blocking output.
+     * In non-blocking mode rendering never waits for the terminal. What the terminal
+     * could not take is kept pending and damage from following frames is merged
+     * into a single frame that is encoded once the pending data is written.
+     * Call flushPending() when outputFd() becomes writable.
+     * Disabling it writes everything pending before returning.
+     *
+     * @return 0 on success, -EBUSY if the render thread is running or disabling
+     *         while a writer is set, other < 0 on error.
+     */
+    int            setNonBlocking(bool enable);
+
+    /**
+     * Hands terminal output to an asynchronous writer shared with other screens.
+     * Frames are queued with the writer and written when it is processed.
+     * Damage from renders while a frame is in flight is merged like in non-blocking
+     * mode, which this enables. The writer must be detached before it is destroyed.
+     *
+     * @param writer : The writer to use. NULL writes directly again.
+     *
+     * @return 0 on success, -EBUSY if the render thread is running or a write
+     *         is in flight, other < 0 on error.
+     */
+    int            setWriter(AsyncWriter *writer);
+
+    /** @return The asynchronous writer in use. NULL if none. */
+    inline AsyncWriter *writer() const { return mWriter; }
+
+    /**
+     * Records every committed frame. The recorder must be detached before it is destroyed.
+     *
+     * @param recorder : The recorder to use. NULL stops recording.
+     *
+     * @return 0 on success, -EBUSY if the render thread is running.
+     */
+    int            setRecorder(Recorder *recorder);
+
+    /** @return The recorder in use. NULL if none. */
+    inline Recorder *recorder() const { return mRecorder; }
+
+    /**
+     * Sends every committed frame to the clients of a stream server.
+     * A memory backed screen then stops encoding terminal output and only serves
+     * as a backend for remote viewers. The server must be detached before it is destroyed.
+     *
+     * @param server : The server to use. NULL stops streaming.
+     *
+     * @return 0 on success, -EBUSY if the render thread is running.
+     */
+    int            setStreamServer(StreamServer *server);
+
+    /** @return The stream server in use. NULL if none. */
+    inline StreamServer *streamServer() const { return mStream; }
+
+    /**
+     * Moves the screen buffer to shared memory other processes can map to read the
+     * screen contents with FramebufferReader. The frames are composited right there,
+     * so nothing is copied. See FramebufferHeader for the layout.
+     *
+     * @param name : Name of the POSIX shared memory object to create, e.g. "/myapp".
+     *               NULL creates an anonymous one to be passed on by file descriptor.
+     *
+     * @return File descriptor of the shared memory on success, -EBUSY if already
+     *         exported, other < 0 on error.
+     */
+    int            exportFramebuffer(const char *name = nullptr);
+
+    /**
+     * Moves the screen buffer back to private memory. A named export is removed.
+     * Readers keep their mapping of the last frame.
+     */
+    void           unexportFramebuffer();
+
+    /** @return true if output is non-blocking. */
+    inline bool    nonBlocking() const { return mNonBlocking; }
+
+    /**
+     * @return The file descriptor the screen writes to. Poll it for POLLOUT while pending().
+     *         -1 if the screen writes to memory.
+     */
+    inline int     outputFd() const { return mFd; }
+
+    /**
+     * @return true if there is output or merged damage waiting for the terminal.
+     *         Always false while the render thread is running.
+     */
+    bool           pending() const;
+
+    /**
+     * Writes pending output and commits merged damage once the terminal took
+     * it all and the next frame is due. Does nothing while the render thread is running.
+     *
+     * @return 0 if nothing is pending anymore, -EAGAIN if the terminal is still busy
+     *         or the next frame is not due yet, other < 0 on error.
+     */
+    int            flushPending();
+
+    /**
+     * Limits how often frames are committed to the terminal.
+     * Damage from renders between two frames is merged and committed at once.
+     * Call flushPending() when frameTimeout() expires to commit the last of it.
+     *
+     * @param fps : Maximum frames per second. 0 commits every render (the default).
+     */
+    void           setFrameRate(unsigned fps);
+
+    /** @return Maximum frames per second. 0 if not limited. */
+    inline unsigned frameRate() const { return mFrameInterval ? 1000000 / mFrameInterval : 0; }
+
+    /**
+     * @return Milliseconds until merged damage is due to be committed, suitable
+     *         as a poll() timeout. 0 if it is due now, -1 if there is none, the
+     *         terminal has yet to take the previous frame (poll outputFd() for
+     *         POLLOUT) or the render thread is running.
+     */
+    int            frameTimeout() const;
+
+    /** @return Cumulative non-blocking output and frame pacing statistics. A copy, like frameStats(). */
+    BackpressureStats backpressureStats() const;
+
+    /**
+     * Adapts the output to the speed of the terminal, e.g. over a congested remote link.
+     * Every 250 ms the backlog of output waiting for the terminal is measured from the
+     * unwritten output and the queue of the terminal, pipe or socket and divided by the
+     * rate the terminal took output at. While it takes longer than latency_ms the level
+     * is raised by one ADAPT_* step every 500 ms. Once it stays below a quarter of that
+     * for 2 s the level is lowered by one step. Restoring colors repaints the screen.
+     *
+     * Frame rate limits apply as with setFrameRate(). Call flushPending() when
+     * frameTimeout() expires. Works best with non-blocking output.
+     *
+     * @param latency_ms : Largest backlog to allow in milliseconds. 0 disables and
+     *                     restores full quality.
+     *
+     * @return 0 on success, -EBUSY if the render thread is running, -EINVAL for
+     *         memory backed screens.
+     */
+    int            setAdaptive(unsigned latency_ms);
+
+    /**
+     * Marks a layer as important, e.g. the part of a dashboard that changes. At
+     * ADAPT_PRIORITY only damage of priority layers is committed each frame. Without
+     * priority layers the level does not go beyond ADAPT_MONO.
+     * Unmark layers before removing or destroying them.
+     *
+     * @param sf       : Surface in the tree of this screen.
+     * @param priority : true to mark, false to unmark.
+     *
+     * @return 0 on success, -EINVAL if sf is NULL.
+     */
+    int            setLayerPriority(Surface *sf, bool priority = true);
+
+    /** @return Adaptive quality measurements and decisions. */
+    inline const AdaptiveStats& adaptiveStats() const { return mAdaptive; }
+
+    /**
+     * Mirrors the screen to another terminal of the same size and capabilities.
+     * Frames are composited and encoded once and the output is written to every
+     * mirror that took all previous output. A mirror that is still busy when a frame
+     * is committed skips frames until it drained and then gets a single diff against
+     * what it shows. A new mirror is cleared and repainted.
+     * Writes to mirrors never block. Poll mirrorFds() for POLLOUT and call flushPending().
+     *
+     * @param fd : Terminal file descriptor. Set to non-blocking mode. Not closed by the screen.
+     *
+     * @return 0 on success, -EBUSY if the render thread is running, -EEXIST if already
+     *         mirrored, other < 0 on error.
+     */
+    int            addMirror(int fd);
+
+    /**
+     * Stops mirroring to a terminal. Output it did not take yet is dropped.
+     *
+     * @return 0 on success, -ENOENT if fd is not mirrored.
+     */
+    int            removeMirror(int fd);
+
+    /** @return File descriptors of the mirrors with output waiting for them. */
+    std::vector<int> mirrorFds() const;
+
+    /**
+     * Starts a dedicated thread that diffs, encodes and writes frames.
+     * Rendering then only copies the finished screen into a triple buffer
+     * and never waits for the terminal. Snapshots the render thread did not
+     * get to are superseded by newer ones. Frame pacing and non-blocking
+     * output apply to the render thread.
+     *
+     * With a pool the frames are encoded by the pool threads shared with other
+     * screens instead. Pooled screens write blocking and commit every snapshot
+     * they get to, frame pacing does not apply.
+     *
+     * @note The surface tree must still be used from a single thread.
+     *
+     * @param pool : Pool to encode on. NULL for a dedicated thread.
+     *
+     * @return 0 on success, -EBUSY if a writer, mirrors, a stream server or adaptive quality
+     *         are set, -EINVAL if pooling non-blocking output, other < 0 on error.
+     */
+    int            startRenderThread(RenderPool *pool = nullptr);
+
+    /** Stops the render thread. The last rendered frame is committed before returning. */
+    void           stopRenderThread();
+
+    /** @return true if the render thread is running or the screen is pooled. */
+    inline bool    renderThreadRunning() const { return mRenderThread.joinable() || mPool; }
+
+    /**
+     * Queries the terminal for its profile and enables the supported optional
+     * features. Sends primary and secondary device attributes, XTGETTCAP for
+     * the name, rep, bce and RGB and DECRQM for synchronized output and SGR mouse
+     * and asks for the kitty keyboard protocol flags, all in a single round trip.
+     *
+     * The profile is cached in $XDG_CACHE_HOME/libconutils (~/.cache/libconutils)
+     * under the name of the terminal type and $TERM_PROGRAM if set and the screen
+     * is the terminal of the process. A cached profile is used without querying
+     * the terminal.
+     *
+     * @warning The terminal replies on the standard input. Call this before
+     *          reading any keys.
+     *
+     * @param timeout_ms : Maximum time to wait for the terminal replies.
+     * @param cache      : Use and update the profile cache.
+     *
+     * @return 0 on success, -EBUSY if the render thread is running or a writer is set,
+     *         other < 0 on error.
+     */
+    int            probeCapabilities(int timeout_ms = 500, bool cache = true);
+
+    /** @return The terminal profile found by probeCapabilities(). */
+    inline const Profile& profile() const { return mProfile; }
+
 private:
-    Screen(size_t width, size_t height);
+    friend class RenderPool;
+
+    Screen(size_t width, size_t height, int fd, int in_fd);
 
     int init();
+    void invalidateFront();
+
+    /* Encoder specialized with the policies of src/encoder.h. Defined in screen.cpp. */
+    typedef void (Screen::*EncodeFn)(const Rect& dirty);
+    template <class Family, class Palette>
+    static const EncodeFn *encoders();
+    template <class Enc>
+    void setAttr(const Attribute& attr);
+    template <class Enc>
     void drawChar(const Char& ch);
+    template <class Enc>
+    bool canReprint(ssize_t from, ssize_t to, ssize_t y) const;
+    template <class Enc>
+    size_t moveHorizontal(ssize_t from, ssize_t to, ssize_t y, bool emit);
+    template <class Enc>
+    void moveCursor(const Point& to);
+    template <class Enc>
+    size_t encodeRun(size_t offset, const Point& pos);
+    template <class Enc>
+    void encode(const Rect& dirty);
+
+    size_t repeatRun(size_t offset, size_t max) const;
+    size_t blankRun(size_t offset, size_t max, size_t& changed) const;
+    size_t rowDiff(ssize_t y, ssize_t front_y) const;
+    void scroll(const Rect& dirty);
+    void encodeFrame(const Rect& dirty);
+    int commitTimeout() const;
+    int commit(bool force = false);
+    void publishStats();
+    void signalRenderThread(uint32_t commands = 0);
+    void runCommands(uint32_t commands);
+    bool takeSlot();
+    void renderStep();
+    void renderLoop();
+    int query(const char *req, size_t len, std::string& reply, int timeout_ms);
+    void renderBegin(const Rect& dirty);
     void renderDone(const Rect& dirty);
+    int mapFramebuffer();
+    void selectEncoders();
+    void adapt();
+    void setAdaptiveLevel(unsigned level);
+    Rect priorityDamage(const Rect& dirty) const;
+    int64_t frameInterval() const;
+
+    /* Frame output buffer handling. */
+    inline void put(char ch) { mOut.push_back(ch); }
+    inline void put(const char *str, size_t len) { mOut.append(str, len); }
+    template <size_t N>
+    inline void put(const char (&str)[N]) { mOut.append(str, N - 1); }
+    void putNum(size_t num);
+    void putParam(uint8_t num);
+    int flush(FrameStats *stats = nullptr);
+    int submit();
+    void writeDone(ssize_t result);
+    void fanOut();
+    void writeMirrors();
+    void flushMirrors();
 
     Rect mBounds;
-    Char mCurrentAttr;
+    /* Terminal attributes during a frame. Valid only if mCurrentAttrValid. */
+    Attribute mCurrentAttr;
+    bool mCurrentAttrValid = false;
+    /* Terminal cursor position during a frame. x < 0 when unknown. */
+    Point mCursor;
     bool mCursorVisible = true;
     int mWinchFd = -1;
+    int mFd = -1;
+    int mInFd = -1;
+    /* Terminal type for the profile cache. */
+    std::string mTerm;
+    /* Output of memory backed screens. */
+    std::mutex mSinkLock;
+    std::string mSink;
+    Profile mProfile;
+    std::atomic<uint32_t> mCaps{0};
+    /* Encoder family and its variants indexed by the enabled encoder capabilities. */
+    Encoder mEncoder = ENCODER_XTERM;
+    std::atomic<const EncodeFn *> mEncoders;
+    std::string mOut;
+    size_t mOutPos = 0;
+    FrameStats mFrameStats;
+    bool mNonBlocking = false;
+    /* Asynchronous writer and the output it is writing. */
+    AsyncWriter *mWriter = nullptr;
+    Recorder *mRecorder = nullptr;
+    StreamServer *mStream = nullptr;
+
+    /* Shared memory the screen buffer lives in. */
+    int mExportFd = -1;
+    std::string mExportName;
+    FramebufferHeader *mExport = nullptr;
+    size_t mExportSize = 0;
+    std::string mWriting;
+    bool mWriteInFlight = false;
+    /* Damage not committed yet, the number of renders in it and when it started. */
+    Rect mDeferred;
+    size_t mDeferredFrames = 0;
+    int64_t mDeferredTime = 0;
+    int64_t mDeferredCollect = 0;
+    int64_t mDeferredCompose = 0;
+    BackpressureStats mBackpressure;
+    /* Adaptive quality. Backlog target in microseconds, 0 if disabled. */
+    int64_t mAdaptTarget = 0;
+    AdaptiveStats mAdaptive;
+    int64_t mAdaptInterval = 0;
+    /* Output the terminal had queued and bytes written at the last measurement. */
+    size_t mAdaptQueued = 0;
+    uint64_t mAdaptWritten = 0;
+    int64_t mAdaptSample = 0;
+    int64_t mAdaptChange = 0;
+    /* Since when the backlog is small. 0 if it is not. */
+    int64_t mAdaptCalm = 0;
+    /* Bytes written to the terminal so far. */
+    uint64_t mWritten = 0;
+    std::vector<Surface *> mPriority;
+    /* Damage held back at ADAPT_PRIORITY and when it was last committed. */
+    Rect mHeld;
+    int64_t mHeldTime = 0;
+    /* Frame pacing in microseconds. */
+    std::atomic<int64_t> mFrameInterval{0};
+    int64_t mLastFrame = 0;
+    /* Frame being encoded. The screen buffer or a render thread snapshot. */
+    const Char *mFrame = nullptr;
+    Rect mFrameBounds;
+    /* Last frame committed to the terminal. */
+    std::vector<Char> mFront;
+    Rect mFrontBounds;
+    /* Row hashes of the screen and the last frame for scroll detection. */
+    std::vector<uint64_t> mRowHash;
+    std::vector<uint64_t> mFrontRowHash;
+
+    /* Terminals the output is mirrored to. */
+    struct Mirror {
+        int fd;
+        std::string out;
+        size_t pos = 0;
+        /* Took all output so far. Otherwise front is what it shows. */
+        bool synced = false;
+        bool fresh = true;
+        int error = 0;
+        std::vector<Char> front;
+        Rect frontBounds;
+    };
+    std::vector<Mirror> mMirrors;
+    /* Output up to here was handed to the synced mirrors. */
+    size_t mMirrorPos = 0;
+    void catchUp(Mirror& m);
+
+    /* Direct mapped cache of encoded SGR transitions. */
+    struct SgrCacheEntry {
+        uint64_t key;
+        uint8_t len;
+        char seq[31];
+    };
+    std::vector<SgrCacheEntry> mSgrCache;
+
+    /* Render thread and the triple buffer of screen snapshots handed to it. */
+    struct RenderSlot {
+        std::vector<Char> data;
+        Rect bounds;
+        Rect dirty;
+        uint64_t seq = 0;
+        int64_t time = 0;
+        int64_t collect_ns = 0;
+        int64_t compose_ns = 0;
+    };
+    RenderSlot mSlots[3];
+    /* Index of the slot ready to be taken and whether it is newer than the taken one. */
+    std::atomic<uint8_t> mSlotReady{2};
+    uint8_t mSlotBack = 0;
+    uint8_t mSlotFront = 1;
+    uint64_t mSlotSeq = 0;
+    uint64_t mTakenSeq = 0;
+    std::thread mRenderThread;
+    RenderPool *mPool = nullptr;
+    /* Set while a pool thread encodes for this screen. Guarded by the pool lock. */
+    bool mPoolBusy = false;
+    std::atomic<bool> mRenderStop{false};
+    int mRenderEventFd = -1;
+    /* Terminal commands requested by other methods while the render thread runs. */
+    std::atomic<uint32_t> mCommands{0};
+    std::atomic<bool> mCommandCursorVisible{false};
+    std::atomic<uint64_t> mCommandCursorPos{0};
+    /* Statistics published by the render thread. */
+    mutable std::mutex mStatsLock;
+    FrameStats mPublishedFrameStats;
+    BackpressureStats mPublishedBackpressure;
+    /* Frame times of the last FRAME_WINDOW frames. Guarded by mStatsLock. */
+    std::vector<int64_t> mFrameTimes;
+    size_t mFrameTimesPos = 0;
 };
 
-/** Singleton class representing the keyboard. */
+/**
+ * Plays recorded frames or captured terminal output back through a screen.
+ * Frames are drawn into a layer covering the screen and rendered, so they pass the
+ * compositor and the encoder like the ones of a program would. With a headless
+ * screen this runs as fast as possible and measures both.
+ *
+ * Captured output is interpreted by a small VT100/xterm emulator. It knows cursor
+ * movement, erasing, scrolling regions, 256 color SGR and skips other sequences.
+ * Truecolor is mapped to the 256 color palette and other than ASCII glyphs to '?'.
+ */
+class Replay {
+public:
+    /** Cumulative replay statistics. */
+    struct Stats {
+        /** Number of frames rendered. */
+        size_t frames = 0;
+        /** Bytes of recorded frames or captured output read. */
+        size_t input_bytes = 0;
+        /** Bytes the screen wrote. */
+        size_t output_bytes = 0;
+        /** Nanoseconds spent playing, waiting for the recorded timing included. */
+        int64_t elapsed_ns = 0;
+
+        /** @return Frames per second. */
+        inline double fps() const { return elapsed_ns ? frames * 1e9 / elapsed_ns : 0; }
+        /** @return Input bytes per second. */
+        inline double inputRate() const { return elapsed_ns ? input_bytes * 1e9 / elapsed_ns : 0; }
+        /** @return Output bytes per second. */
+        inline double outputRate() const { return elapsed_ns ? output_bytes * 1e9 / elapsed_ns : 0; }
+    };
+
+    /**
+     * @param screen : Screen to play on. Frames larger than it are cropped.
+     *                 Output of a memory backed screen is discarded.
+     */
+    Replay(Screen *screen);
+    ~Replay();
+
+    /**
+     * Sets the playback speed of recordings.
+     *
+     * @param speed : Multiple of the recorded timing. 0 == as fast as possible, the default.
+     */
+    inline void    setSpeed(double speed) { mSpeed = speed; }
+
+    /**
+     * Plays frames of a recording from its current position.
+     *
+     * @param frames : Maximum number of frames to play. 0 == up to the end.
+     *
+     * @return Number of frames played, < 0 on error.
+     */
+    int            play(Recording& recording, size_t frames = 0);
+
+    /**
+     * Plays captured terminal output. The emulator state carries over to the next call,
+     * so a capture can be fed in pieces.
+     * A frame ends with every synchronized update (DEC private mode 2026) and,
+     * if given, after every frame_bytes of input.
+     *
+     * @param data        : Captured output.
+     * @param len         : Its length.
+     * @param frame_bytes : Bytes of input after which a frame ends. 0 == only at
+     *                      synchronized updates and at the end of data.
+     *
+     * @return Number of frames played.
+     */
+    int            playAnsi(const char *data, size_t len, size_t frame_bytes = 0);
+
+    /** Resets the emulator to a blank screen. */
+    void           reset();
+
+    /** @return Cumulative statistics. */
+    inline const Stats& stats() const { return mStats; }
+
+    /** Resets the statistics. */
+    inline void    resetStats() { mStats = Stats(); }
+
+private:
+    /* Disallow replay copying. */
+    Replay(const Replay&);
+    const Replay& operator= (const Replay&);
+
+    enum {
+        ST_GROUND,
+        ST_ESC,
+        ST_CSI,
+        ST_STRING,
+        ST_STRING_ESC,
+        ST_CHARSET,
+    };
+
+    bool endFrame();
+    bool feed(char c);
+    void print(char c);
+    void lineFeed();
+    void scroll(ssize_t top, ssize_t bottom, ssize_t n);
+    void erase(ssize_t x0, ssize_t y0, ssize_t x1, ssize_t y1);
+    void csi(char final);
+    void sgr();
+    unsigned param(size_t i, unsigned def = 1) const;
+
+    Screen *mScreen;
+    Surface mSurface;
+    double mSpeed = 0;
+    Stats mStats;
+    /* Bounds of the last recorded frame played. */
+    Rect mBounds;
+
+    /* Emulator state. */
+    int mState = ST_GROUND;
+    std::vector<unsigned> mParams;
+    /* Set for parameters that follow a ':', the subparameters of the one before. */
+    std::vector<bool> mSubParams;
+    char mPrefix = 0;
+    bool mIntermediate = false;
+    bool mSyncEnd = false;
+    Point mCursor;
+    Point mSavedCursor;
+    bool mWrap = false;
+    Attribute mAttr;
+    Attribute mSavedAttr;
+    ssize_t mTop = 0;
+    ssize_t mBottom = 0;
+    char mLast = ' ';
+    Rect mDirty;
+};
+
+/**
+ * Singleton class representing the keyboard.
+ * Keyboards of other terminals can be made with create().
+ */
 class Keyboard
 {
 public:
@@ -682,6 +2124,23 @@ public:
     /** @return Pointer to the keyboard instance. NULL if something went wrong. */
     static Keyboard *getInstance();
 
+    /**
+     * Creates a keyboard reading from the terminal on fd, e.g. a pseudo terminal
+     * of a session. The terminal settings of fd are restored on destruction.
+     *
+     * @param fd   : Terminal file descriptor. Not closed by the keyboard.
+     * @param term : Terminal type to pick the key map for. NULL for $TERM.
+     *
+     * @return The new keyboard. NULL if something went wrong.
+     */
+    static std::unique_ptr<Keyboard> create(int fd, const char *term = nullptr);
+
+    /**
+     * @return The file descriptor keys are read from. Poll it for POLLIN
+     *         and call waitForKey(0) to serve many keyboards from one loop.
+     */
+    inline int       fd() const { return mFds.fd; }
+
     /**
      * Waits for a key to be pressed.
      *
@@ -697,12 +2156,17 @@ public:
     int              waitForKey(int timeout_ms = -1);
 
 private:
+    Keyboard(int fd);
+
+    int init(const char *term);
     int pollOnce(int timeout_ms = -1);
     int parseEsc();
 
     struct termios mOldTermios;
     struct termios mNewTermios;
     struct pollfd mFds;
+    bool mTermiosSaved = false;
+    const struct term_keymap *mKeymap = nullptr;
 };
 
 } /* namespace conutils */
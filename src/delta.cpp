@@ -0,0 +1,308 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+
+#include "delta.h"
+
+using namespace std;
+
+namespace conutils {
+
+/* Unchanged cells a span takes along instead of starting a new one. */
+#define SPAN_GAP      4
+/* Identical cells worth a repeated run. */
+#define MIN_REPEAT    4
+
+void delta_put_le(string& buf, uint64_t val, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++, val >>= 8)
+        buf += (char)(val & 0xff);
+}
+
+static void set_le(string& buf, size_t pos, uint64_t val, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++, val >>= 8)
+        buf[pos + i] = (char)(val & 0xff);
+}
+
+uint64_t delta_get_le(const uint8_t *p, size_t bytes)
+{
+    uint64_t val = 0;
+
+    for (size_t i = bytes; i > 0; i--)
+        val = val << 8 | p[i - 1];
+    return val;
+}
+
+static void put_varint(string& buf, uint64_t val)
+{
+    while (val >= 0x80) {
+        buf += (char)(val | 0x80);
+        val >>= 7;
+    }
+    buf += (char)val;
+}
+
+static bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t& val)
+{
+    val = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+
+        val |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+/* Number of leading cells that are equal, compared a word at a time. */
+static size_t equal_cells(const Char *a, const Char *b, size_t n)
+{
+    const char *pa = (const char *)a, *pb = (const char *)b;
+    size_t bytes = n * sizeof(Char), i = 0;
+    uint64_t wa, wb;
+
+    for (; i + sizeof(wa) <= bytes; i += sizeof(wa)) {
+        memcpy(&wa, pa + i, sizeof(wa));
+        memcpy(&wb, pb + i, sizeof(wb));
+        if (wa != wb)
+            break;
+    }
+
+    for (i /= sizeof(Char); i < n && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+/* Number of leading cells that differ. */
+static size_t changed_cells(const Char *a, const Char *b, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n && a[i] != b[i])
+        i++;
+    return i;
+}
+
+static void encode_span(string& buf, const Char *cells, size_t len, Attribute& attr)
+{
+    const Char *c = cells, *end = cells + len;
+
+    while (c < end) {
+        const Char *run = c + 1, *same = c;
+        bool repeat;
+
+        while (run < end && *run == *c)
+            run++;
+
+        repeat = run - c >= MIN_REPEAT;
+
+        /* Glyphs sharing the attribute up to the next repeated run. */
+        if (!repeat) {
+            for (run = c + 1; run < end && run->attr == c->attr; run++) {
+                if (run->val != run[-1].val) {
+                    same = run;
+                } else if (run - same + 1 >= MIN_REPEAT) {
+                    run = same;
+                    break;
+                }
+            }
+        }
+
+        bool attr_changed = c->attr != attr;
+
+        put_varint(buf, (uint64_t)(run - c) << 2 | repeat << 1 | attr_changed);
+        if (attr_changed) {
+            attr = c->attr;
+            buf += (char)attr.fg;
+            buf += (char)attr.bg;
+            buf += (char)attr.flags;
+        }
+
+        if (repeat) {
+            buf += c->val;
+        } else {
+            size_t pos = buf.size();
+
+            buf.resize(pos + (run - c));
+            for (const Char *g = c; g < run; g++)
+                buf[pos++] = g->val;
+        }
+
+        c = run;
+    }
+}
+
+size_t delta_encode(string& buf, const Char *data, const Rect& bounds, const Rect& dirty,
+                    vector<Char>& prev, Rect& prev_bounds, bool keyframe, int64_t time)
+{
+    size_t pos = buf.size(), cells = 0;
+    Attribute attr;
+    Rect changed;
+
+    keyframe = keyframe || bounds != prev_bounds;
+    buf.append(DELTA_HEADER_SIZE, 0);
+
+    if (keyframe) {
+        prev.assign(data, data + bounds.size());
+        prev_bounds = bounds;
+        changed = Rect(0, 0, bounds.width(), bounds.height());
+
+        put_varint(buf, 0);
+        put_varint(buf, bounds.size());
+        encode_span(buf, data, bounds.size(), attr);
+        cells = bounds.size();
+    } else {
+        Rect d(max(dirty.top.x, bounds.top.x), max(dirty.top.y, bounds.top.y),
+               min(dirty.bottom.x, bounds.bottom.x), min(dirty.bottom.y, bounds.bottom.y));
+        size_t cursor = 0, span = 0, span_end = 0;
+        bool in_span = false;
+
+        /* Cells outside the dirty region and between spans equal the previous frame. */
+        auto flush_span = [&]() {
+            put_varint(buf, span - cursor);
+            put_varint(buf, span_end - span);
+            encode_span(buf, data + span, span_end - span, attr);
+            std::copy(data + span, data + span_end, prev.begin() + span);
+            cells += span_end - span;
+            cursor = span_end;
+        };
+
+        for (ssize_t y = d.top.y; d.valid() && y < d.bottom.y; y++) {
+            size_t row = bounds.index_for(Point(d.top.x, y));
+            size_t width = d.width();
+
+            for (size_t x = 0; x < width;) {
+                x += equal_cells(data + row + x, &prev[row + x], width - x);
+                if (x == width)
+                    break;
+
+                size_t n = changed_cells(data + row + x, &prev[row + x], width - x);
+                ssize_t cx = d.top.x - bounds.top.x + x, cy = y - bounds.top.y;
+
+                if (changed.valid()) {
+                    changed.top.x = min(changed.top.x, cx);
+                    changed.bottom.x = max(changed.bottom.x, cx + (ssize_t)n);
+                    changed.bottom.y = cy + 1;
+                } else {
+                    changed = Rect(cx, cy, cx + n, cy + 1);
+                }
+
+                if (!in_span || row + x - span_end > SPAN_GAP) {
+                    if (in_span)
+                        flush_span();
+                    span = row + x;
+                    in_span = true;
+                }
+
+                x += n;
+                span_end = row + x;
+            }
+        }
+
+        if (in_span)
+            flush_span();
+    }
+
+    buf[pos] = keyframe ? DELTA_KEYFRAME : DELTA_FRAME;
+    set_le(buf, pos + 1, buf.size() - pos - DELTA_HEADER_SIZE, 4);
+    set_le(buf, pos + 5, time, 8);
+    set_le(buf, pos + 13, bounds.width(), 2);
+    set_le(buf, pos + 15, bounds.height(), 2);
+    set_le(buf, pos + 17, changed.top.x, 2);
+    set_le(buf, pos + 19, changed.top.y, 2);
+    set_le(buf, pos + 21, changed.bottom.x, 2);
+    set_le(buf, pos + 23, changed.bottom.y, 2);
+    return cells;
+}
+
+size_t delta_record_size(const uint8_t *rec, size_t len)
+{
+    size_t size;
+
+    if (len < DELTA_HEADER_SIZE)
+        return 0;
+
+    size = DELTA_HEADER_SIZE + delta_get_le(rec + 1, 4);
+    return size <= len ? size : 0;
+}
+
+int delta_decode(const uint8_t *rec, vector<Char>& cells, Rect& bounds, Rect& dirty, int64_t& time)
+{
+    const uint8_t *p = rec + DELTA_HEADER_SIZE;
+    const uint8_t *end = p + delta_get_le(rec + 1, 4);
+    size_t width = delta_get_le(rec + 13, 2);
+    size_t height = delta_get_le(rec + 15, 2);
+    size_t cell = 0;
+    Attribute attr;
+    uint64_t skip, n, run;
+
+    if (rec[0] == DELTA_KEYFRAME) {
+        bounds = Rect(0, 0, width, height);
+        cells.assign(bounds.size(), Char());
+    } else if (rec[0] != DELTA_FRAME || bounds.width() != width || bounds.height() != height || cells.empty()) {
+        return -EINVAL;
+    }
+
+    while (p < end) {
+        if (!get_varint(p, end, skip) || !get_varint(p, end, n))
+            return -EINVAL;
+        if (skip > cells.size() - cell || n > cells.size() - cell - skip)
+            return -EINVAL;
+
+        Char *c = cells.data() + cell + skip;
+        cell += skip + n;
+
+        while (n) {
+            if (!get_varint(p, end, run) || !(run >> 2) || (run >> 2) > n)
+                return -EINVAL;
+
+            if (run & 1) {
+                if (end - p < 3)
+                    return -EINVAL;
+                attr = Attribute(p[0], p[1], p[2]);
+                p += 3;
+            }
+
+            size_t k = run >> 2;
+            if (end - p < (run & 2 ? 1 : (ssize_t)k))
+                return -EINVAL;
+
+            for (size_t i = 0; i < k; i++, c++) {
+                c->val = (char)(run & 2 ? p[0] : p[i]);
+                c->attr = attr;
+            }
+
+            p += run & 2 ? 1 : k;
+            n -= k;
+        }
+    }
+
+    dirty = Rect(delta_get_le(rec + 17, 2), delta_get_le(rec + 19, 2), delta_get_le(rec + 21, 2), delta_get_le(rec + 23, 2));
+    time = delta_get_le(rec + 5, 8);
+    return 0;
+}
+
+} /* namespace conutils */
@@ -0,0 +1,67 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONUTILS_DELTA_H__
+#define __CONUTILS_DELTA_H__
+
+#include "conutils.h"
+
+namespace conutils {
+
+/*
+ * Cell delta records of recordings and streams. Numbers are little endian.
+ *
+ * record : u8 type, u32 payload length, i64 time in us, u16 width, u16 height,
+ *          u16 left, top, right, bottom of the changed cells, payload
+ *
+ * Frame payloads are spans of varint cells to skip and varint cells that follow as runs.
+ * A run is a varint of its length << 2 | glyph repeated << 1 | attribute follows, then
+ * fg, bg and flags if they changed and one glyph or a glyph per cell.
+ */
+#define DELTA_HEADER_SIZE 25
+
+enum {
+    DELTA_KEYFRAME = 1,
+    DELTA_FRAME    = 2,
+    DELTA_INDEX    = 3,
+};
+
+void delta_put_le(std::string& buf, uint64_t val, size_t bytes);
+uint64_t delta_get_le(const uint8_t *p, size_t bytes);
+
+/*
+ * Appends a record of a frame. A keyframe stores all cells, other records the cells
+ * in dirty that differ from prev. A frame of other bounds than prev is a keyframe.
+ * prev and prev_bounds are updated to the frame. Returns the number of cells stored.
+ */
+size_t delta_encode(std::string& buf, const Char *data, const Rect& bounds, const Rect& dirty,
+                    std::vector<Char>& prev, Rect& prev_bounds, bool keyframe, int64_t time);
+
+/* Returns the size of the record at rec if it is complete within len bytes, else 0. */
+size_t delta_record_size(const uint8_t *rec, size_t len);
+
+/*
+ * Applies a complete frame record to cells of bounds. Returns 0 on success,
+ * -EINVAL if it is malformed or a delta of a frame of other bounds.
+ */
+int delta_decode(const uint8_t *rec, std::vector<Char>& cells, Rect& bounds, Rect& dirty, int64_t& time);
+
+} /* namespace conutils */
+
+#endif /* __CONUTILS_DELTA_H__ */
@@ -0,0 +1,130 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONUTILS_ENCODER_H__
+#define __CONUTILS_ENCODER_H__
+
+#include "conutils.h"
+
+namespace conutils {
+
+/*
+ * Policies the screen encoder is specialized with. A palette maps the 256 color
+ * indexes of the cells to what the terminal shows and adds their SGR parameters.
+ * A family tells the capabilities the terminal can have at most and its SGR dialect.
+ * Each combination of family, palette and enabled capabilities is a separate
+ * instantiation of the encoder, picked once per frame.
+ */
+
+/* 256 color indexes (SGR 38;5 and 48;5). */
+struct palette256 {
+    static constexpr unsigned id = 0;
+
+    static constexpr uint8_t color(uint8_t c) { return c; }
+
+    template <class P>
+    static inline void fg(P& params, uint8_t c) { params.push(38, 5, c); }
+    template <class P>
+    static inline void bg(P& params, uint8_t c) { params.push(48, 5, c); }
+};
+
+/* The 16 ANSI colors (SGR 30-37, 90-97 and 40-47, 100-107). */
+struct palette16 {
+    static constexpr unsigned id = 1;
+
+    /* Nearest of the 16 colors to each of the 256 with the default xterm palette. */
+    static constexpr uint8_t map[256] = {
+         0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+         0,  0,  4,  4,  4,  4,  0,  0,  6,  4,  4, 12,  2,  2,  6,  6,
+         6,  6,  2,  2,  6,  6,  6,  6,  2,  2,  6,  6,  6, 14, 10, 10,
+         6,  6, 14, 14,  0,  0,  5,  4,  4, 12,  0,  8,  8,  8, 12, 12,
+         2,  8,  8,  8, 12, 12,  2,  8,  8,  8, 12, 12,  2,  8,  8,  6,
+         6, 14, 10, 10,  6,  6, 14, 14,  1,  1,  5,  5,  5,  5,  1,  8,
+         8,  8, 12, 12,  3,  8,  8,  8, 12, 12,  3,  8,  8,  8,  8, 12,
+         3,  8,  8,  8,  7,  7,  3,  3,  8,  7,  7,  7,  1,  1,  5,  5,
+         5,  5,  1,  8,  8,  8, 12, 12,  3,  8,  8,  8,  8, 12,  3,  8,
+         8,  8,  7,  7,  3,  3,  8,  7,  7,  7,  3,  3,  7,  7,  7,  7,
+         1,  1,  5,  5,  5, 13,  1,  8,  8,  5,  5, 13,  3,  8,  8,  8,
+         7,  7,  3,  3,  8,  7,  7,  7,  3,  3,  7,  7,  7,  7, 11, 11,
+         7,  7,  7,  7,  9,  9,  5,  5, 13, 13,  9,  9,  5,  5, 13, 13,
+         3,  3,  8,  7,  7,  7,  3,  3,  7,  7,  7,  7, 11, 11,  7,  7,
+         7,  7, 11, 11,  7,  7,  7, 15,  0,  0,  0,  0,  0,  0,  8,  8,
+         8,  8,  8,  8,  8,  8,  8,  8,  8,  7,  7,  7,  7,  7,  7,  7,
+    };
+
+    /* SGR parameters of the foreground colors. Backgrounds are 10 more. */
+    static constexpr uint8_t sgr[16] = {
+        30, 31, 32, 33, 34, 35, 36, 37, 90, 91, 92, 93, 94, 95, 96, 97,
+    };
+
+    static inline uint8_t color(uint8_t c) { return map[c]; }
+
+    template <class P>
+    static inline void fg(P& params, uint8_t c) { params.push(sgr[c]); }
+    template <class P>
+    static inline void bg(P& params, uint8_t c) { params.push(sgr[c] + 10); }
+};
+
+/* No colors, only the attribute flags. */
+struct palette_mono {
+    static constexpr unsigned id = 2;
+
+    static constexpr uint8_t color(uint8_t) { return 0; }
+
+    template <class P>
+    static inline void fg(P&, uint8_t) { }
+    template <class P>
+    static inline void bg(P&, uint8_t) { }
+};
+
+/* xterm and compatible terminals. All encoder capabilities. */
+struct xterm_family {
+    static constexpr uint32_t caps = Screen::CAP_REP | Screen::CAP_ERASE | Screen::CAP_SCROLL | Screen::CAP_SYNC;
+    /* Attribute flags can be reset one by one (SGR 22, 24, 25 and 27). */
+    static constexpr bool sgr_off = true;
+};
+
+/* Linux console. It knows ECH and EL but neither REP, SU, SD nor synchronized output. */
+struct linux_family {
+    static constexpr uint32_t caps = Screen::CAP_ERASE;
+    static constexpr bool sgr_off = true;
+};
+
+/* VT100. Attribute flags are only reset all at once with SGR 0. */
+struct vt100_family {
+    static constexpr uint32_t caps = 0;
+    static constexpr bool sgr_off = false;
+};
+
+template <class Family, class Palette, uint32_t Caps>
+struct encoder : Palette {
+    static constexpr uint32_t caps = Caps & Family::caps;
+    static constexpr bool sgr_off = Family::sgr_off;
+    /* Tells apart the SGR sequences of different dialects in the cache. */
+    static constexpr unsigned dialect = Palette::id << 1 | sgr_off;
+
+    static inline Attribute attr(const Attribute& a)
+    {
+        return Attribute(Palette::color(a.fg), Palette::color(a.bg), a.flags);
+    }
+};
+
+} /* namespace conutils */
+
+#endif /* __CONUTILS_ENCODER_H__ */
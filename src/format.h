@@ -0,0 +1,89 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONUTILS_FORMAT_H__
+#define __CONUTILS_FORMAT_H__
+
+#include <string>
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace conutils {
+
+/*
+ * Decimal formatting of escape sequence parameters. Appends straight to the
+ * frame buffer without allocating or going through locale machinery.
+ */
+
+/* Decimal digit pairs "00" to "99". */
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Decimal strings of all 8 bit values. The last byte of each is the length. */
+static const struct u8_digits {
+    char str[256][4];
+
+    u8_digits()
+    {
+        for (int n = 0; n < 256; n++)
+            str[n][3] = snprintf(str[n], 4, "%d", n);
+    }
+} u8_digits;
+
+/* Appends num in decimal, two digits at a time. */
+static inline void format_num(std::string& out, size_t num)
+{
+    char buf[20];
+    char *p = buf + sizeof(buf);
+    const char *d;
+
+    while (num >= 100) {
+        d = digit_pairs + (num % 100) * 2;
+        num /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+
+    if (num >= 10) {
+        d = digit_pairs + num * 2;
+        *--p = d[1];
+        *--p = d[0];
+    } else {
+        *--p = '0' + num;
+    }
+
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+/* Appends an 8 bit num in decimal from the table. */
+static inline void format_u8(std::string& out, uint8_t num)
+{
+    const char *str = u8_digits.str[num];
+
+    out.append(str, str[3]);
+}
+
+} /* namespace conutils */
+
+#endif /* __CONUTILS_FORMAT_H__ */
@@ -0,0 +1,170 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+FramebufferReader::~FramebufferReader()
+{
+    close();
+}
+
+int FramebufferReader::open(const char *name)
+{
+    int fd, ret;
+
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    ret = open(fd);
+    ::close(fd);
+    return ret;
+}
+
+int FramebufferReader::open(int fd)
+{
+    struct stat st;
+    int ret;
+
+    close();
+
+    if (fstat(fd, &st))
+        return -errno;
+    if ((size_t)st.st_size < sizeof(FramebufferHeader))
+        return -EINVAL;
+
+    mFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (mFd < 0)
+        return -errno;
+
+    ret = map(st.st_size);
+    if (!ret && (memcmp(mHeader->magic, "conufb1", sizeof(mHeader->magic)) || mHeader->cell_size != sizeof(Char)))
+        ret = -EINVAL;
+
+    if (ret)
+        close();
+    return ret;
+}
+
+void FramebufferReader::close()
+{
+    if (mHeader)
+        munmap(mHeader, mSize);
+    if (mFd >= 0)
+        ::close(mFd);
+
+    mHeader = nullptr;
+    mSize = 0;
+    mFd = -1;
+    mWidth = mHeight = 0;
+    mGeneration = 0;
+    mDirty = Rect();
+    mCells = nullptr;
+}
+
+int FramebufferReader::map(size_t size)
+{
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, mFd, 0);
+
+    if (map == MAP_FAILED)
+        return -errno;
+
+    if (mHeader)
+        munmap(mHeader, mSize);
+
+    mHeader = (FramebufferHeader *)map;
+    mSize = size;
+    return 0;
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int FramebufferReader::begin(uint64_t& seq, int timeout_ms)
+{
+    int64_t deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : 0;
+    uint64_t size, end;
+    uint32_t width, height, offset;
+    Rect dirty;
+    int ret;
+
+    mCells = nullptr;
+
+    while (true) {
+        seq = mHeader->seq.load(memory_order_acquire);
+        if (seq & 1) {
+            /* A screen that died while updating never finishes. */
+            if (timeout_ms >= 0 && now_ms() >= deadline)
+                return -ETIMEDOUT;
+
+            sched_yield();
+            continue;
+        }
+
+        /* Take the header as a whole. The accessors must not see a later resize. */
+        size = mHeader->size;
+        width = mHeader->width;
+        height = mHeader->height;
+        offset = mHeader->offset;
+        dirty = Rect(mHeader->dirty_left, mHeader->dirty_top, mHeader->dirty_right, mHeader->dirty_bottom);
+        mGeneration = mHeader->generation;
+        if (retry(seq))
+            continue;
+
+        end = offset + (uint64_t)width * height * sizeof(Char);
+        if (offset < sizeof(FramebufferHeader) || end > size)
+            return -EINVAL;
+
+        /* The screen grew. Cells may lie past the mapping. */
+        if (end > mSize) {
+            ret = map(size);
+            if (ret)
+                return ret;
+            continue;
+        }
+
+        mWidth = width;
+        mHeight = height;
+        mDirty = dirty;
+        mCells = (const Char *)((const char *)mHeader + offset);
+        return 0;
+    }
+}
+
+bool FramebufferReader::retry(uint64_t seq) const
+{
+    atomic_thread_fence(memory_order_acquire);
+    return mHeader->seq.load(memory_order_relaxed) != seq;
+}
@@ -70,11 +70,3 @@ string Rect::str() const
 {
     return top.str() + ", " + bottom.str();
 }
-
-Screen::Screen(size_t width, size_t height)
-    : Surface(width, height)
-{
-    mBounds = {0, 0, (ssize_t)width, (ssize_t)height};
-    hideCursor();
-}
-
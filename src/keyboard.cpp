@@ -20,6 +20,9 @@
 #include <map>
 #include <vector>
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "conutils.h"
@@ -29,11 +32,15 @@ using namespace conutils;
 
 typedef map<char, int (*)(const vector<int>&)> keymap;
 
+namespace conutils {
+
 struct term_keymap {
     const char *name;
     keymap map;
 };
 
+} /* namespace conutils */
+
 /* Helper for parameters and meta keys setup */
 static int esc_seq_param(const vector<int>& params, int key)
 {
@@ -47,6 +54,69 @@ static int esc_seq_param(const vector<int>& params, int key)
     return ret_key;
 }
 
+/* Helper for ESC [ code ~ keys */
+static int esc_seq_tilde(const vector<int>& params)
+{
+    int key;
+
+    if (params.empty())
+        return Keyboard::KEY_UNKNOWN;
+
+    switch (params[0]) {
+    case 1:
+        key = Keyboard::KEY_HOME;
+        break;
+    case 2:
+        key = Keyboard::KEY_INS;
+        break;
+    case 3:
+        key = Keyboard::KEY_DEL;
+        break;
+    case 4:
+        key = Keyboard::KEY_END;
+        break;
+    case 5:
+        key = Keyboard::KEY_PGUP;
+        break;
+    case 6:
+        key = Keyboard::KEY_PGDOWN;
+        break;
+    case 15:
+        key = Keyboard::KEY_F5;
+        break;
+    case 17:
+        key = Keyboard::KEY_F6;
+        break;
+    case 18:
+        key = Keyboard::KEY_F7;
+        break;
+    case 19:
+        key = Keyboard::KEY_F8;
+        break;
+    case 20:
+        key = Keyboard::KEY_F9;
+        break;
+    case 21:
+        key = Keyboard::KEY_F10;
+        break;
+    case 23:
+        key = Keyboard::KEY_F11;
+        break;
+    case 24:
+        key = Keyboard::KEY_F12;
+        break;
+    default:
+        return Keyboard::KEY_UNKNOWN;
+    }
+
+    if (params.size() == 2 && params[1] >= 1 && params[1] <= 8)
+        key += params[1] * Keyboard::MOD_META;
+    if (params.size() > 2)
+        key = Keyboard::KEY_UNKNOWN;
+
+    return key;
+}
+
 /* Helper macros for keymap entries */
 #define PARAM(key) [](const vector<int>& params) { return esc_seq_param(params, (key)); }
 
@@ -56,62 +126,7 @@ static term_keymap xterm_keymap = {
     .name = "xterm",
 
     .map = {
-        { '~', [](const vector<int>& params)
-               {
-                   int key;
-
-                   if (params.empty())
-                       return (int)Keyboard::KEY_UNKNOWN;
-
-                   switch (params[0]) {
-                   case 2:
-                       key = Keyboard::KEY_INS;
-                       break;
-                   case 3:
-                       key = Keyboard::KEY_DEL;
-                       break;
-                   case 5:
-                       key = Keyboard::KEY_PGUP;
-                       break;
-                   case 6:
-                       key = Keyboard::KEY_PGDOWN;
-                       break;
-                   case 15:
-                       key = Keyboard::KEY_F5;
-                       break;
-                   case 17:
-                       key = Keyboard::KEY_F6;
-                       break;
-                   case 18:
-                       key = Keyboard::KEY_F7;
-                       break;
-                   case 19:
-                       key = Keyboard::KEY_F8;
-                       break;
-                   case 20:
-                       key = Keyboard::KEY_F9;
-                       break;
-                   case 21:
-                       key = Keyboard::KEY_F10;
-                       break;
-                   case 23:
-                       key = Keyboard::KEY_F11;
-                       break;
-                   case 24:
-                       key = Keyboard::KEY_F12;
-                       break;
-                   default:
-                       return (int)Keyboard::KEY_UNKNOWN;
-                   }
-
-                   if (params.size() == 2 && params[1] >= 1 && params[1] <= 8)
-                       key += params[1] * Keyboard::MOD_META;
-                   if (params.size() > 2)
-                       key = Keyboard::KEY_UNKNOWN;
-
-                   return (int)key;
-               }
-        },
+        { '~', esc_seq_tilde },
 
         { 'A', PARAM(Keyboard::KEY_UP) },
         { 'B', PARAM(Keyboard::KEY_DOWN) },
@@ -128,12 +143,68 @@ static term_keymap xterm_keymap = {
     },
 };
 
-static term_keymap *term_keymap;
+/* Linux console keymap. F1 to F5 are ESC [ [ A to E. */
+
+static term_keymap linux_keymap = {
+    .name = "linux",
+
+    .map = {
+        { '~', esc_seq_tilde },
+
+        { '[', [](const vector<int>& params)
+               {
+                   if (params.size() != 1 || params[0] < 'A' || params[0] > 'E')
+                       return (int)Keyboard::KEY_UNKNOWN;
+
+                   return (int)Keyboard::KEY_F1 + params[0] - 'A';
+               }
+        },
+
+        { 'A', PARAM(Keyboard::KEY_UP) },
+        { 'B', PARAM(Keyboard::KEY_DOWN) },
+        { 'C', PARAM(Keyboard::KEY_RIGHT) },
+        { 'D', PARAM(Keyboard::KEY_LEFT) },
+    },
+};
+
+/* Keymaps by $TERM prefix. The last one is the default. */
+static term_keymap *term_keymaps[] = { &linux_keymap, &xterm_keymap };
+
+Keyboard::Keyboard(int fd)
+{
+    mFds.fd = fd;
+    mFds.events = POLLIN;
+}
 
 Keyboard::~Keyboard()
 {
     /* Restore terminal settings. */
-    tcsetattr(STDIN_FILENO, TCSANOW, &mOldTermios);
+    if (mTermiosSaved)
+        tcsetattr(mFds.fd, TCSANOW, &mOldTermios);
+}
+
+int Keyboard::init(const char *term)
+{
+    if (tcgetattr(mFds.fd, &mNewTermios))
+        return -errno;
+
+    /* Save terminal settings. */
+    mOldTermios = mNewTermios;
+    mTermiosSaved = true;
+
+    mNewTermios.c_lflag &= ~(ECHO | ICANON);
+
+    if (tcsetattr(mFds.fd, TCSAFLUSH, &mNewTermios))
+        return -errno;
+
+    /* Most terminals emulate xterm. Others are told apart by their type. */
+    for (auto map : term_keymaps) {
+        mKeymap = map;
+        if (term && !strncmp(term, map->name, strlen(map->name)))
+            break;
+    }
+
+    return 0;
 }
 
 Keyboard *Keyboard::getInstance()
@@ -144,7 +215,7 @@ Keyboard *Keyboard::getInstance()
     if (instance)
         return instance.get();
 
-    instance = unique_ptr<Keyboard>(new Keyboard());
+    instance = unique_ptr<Keyboard>(new Keyboard(STDIN_FILENO));
     kb = instance.get();
     if (!kb)
         return nullptr;
@@ -156,23 +227,19 @@ Keyboard *Keyboard::getInstance()
     /* Write/discard already buffered data in the stream. */
     fflush(stdin);
 
-    if (tcgetattr(STDIN_FILENO, &kb->mNewTermios))
+    if (kb->init(getenv("TERM")))
         return nullptr;
 
-    /* Save terminal settings. */
-    kb->mOldTermios = kb->mNewTermios;
+    return kb;
+}
 
-    kb->mNewTermios.c_lflag &= ~(ECHO | ICANON);
+unique_ptr<Keyboard> Keyboard::create(int fd, const char *term)
+{
+    unique_ptr<Keyboard> kb(new Keyboard(fd));
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &kb->mNewTermios))
+    if (kb->init(term ? term : getenv("TERM")))
         return nullptr;
 
-    kb->mFds.fd = STDIN_FILENO;
-    kb->mFds.events = POLLIN;
-
-    /* TODO: detect terminal for key maps. Default to xterm for now. */
-    term_keymap = &xterm_keymap;
-
     return kb;
 }
 
@@ -187,7 +254,7 @@ int Keyboard::pollOnce(int timeout_ms)
     if (!rc)
         return -ETIMEDOUT;
 
-    rc = read(STDIN_FILENO, &key, 1);
+    rc = read(mFds.fd, &key, 1);
     if (rc < 0)
         return rc;
 
@@ -236,9 +303,19 @@ int Keyboard::parseEsc()
         }
     }
 
-    auto entry = term_keymap->map.find(key);
+    /* ESC [ [ key. Pass the final key as parameter. */
+    if (key == '[' && params.empty()) {
+        key = pollOnce();
+        if (key < 0)
+            return key;
+
+        params.push_back(key);
+        key = '[';
+    }
+
+    auto entry = mKeymap->map.find(key);
     key = KEY_UNKNOWN;
-    if (entry != term_keymap->map.end())
+    if (entry != mKeymap->map.end())
         key = entry->second(params);
 
     return key;
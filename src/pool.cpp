@@ -0,0 +1,139 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+RenderPool::RenderPool(unsigned threads)
+{
+    struct epoll_event ev = {};
+
+    if (!threads)
+        threads = max(1U, thread::hardware_concurrency());
+
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    mStopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEpollFd < 0 || mStopFd < 0)
+        return;
+
+    /* Level triggered and never read. Wakes all threads up for good. */
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mStopFd, &ev))
+        return;
+
+    for (unsigned i = 0; i < threads; i++)
+        mThreads.push_back(thread(&RenderPool::worker, this));
+}
+
+RenderPool::~RenderPool()
+{
+    uint64_t one = 1;
+
+    if (!mThreads.empty() && write(mStopFd, &one, sizeof(one)) == sizeof(one)) {
+        for (thread& t : mThreads)
+            t.join();
+    }
+
+    close(mStopFd);
+    close(mEpollFd);
+}
+
+int RenderPool::add(Screen *sc, int event_fd)
+{
+    struct epoll_event ev = {};
+    lock_guard<mutex> lock(mLock);
+
+    if (mThreads.empty())
+        return -EINVAL;
+
+    /* One shot so that only one thread at a time gets the screen. */
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = sc;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, event_fd, &ev))
+        return -errno;
+
+    mScreens.insert(sc);
+    return 0;
+}
+
+void RenderPool::remove(Screen *sc, int event_fd)
+{
+    unique_lock<mutex> lock(mLock);
+
+    mScreens.erase(sc);
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, event_fd, nullptr);
+
+    /* A thread may still be encoding for it. */
+    mIdle.wait(lock, [sc] { return !sc->mPoolBusy; });
+}
+
+void RenderPool::worker()
+{
+    struct epoll_event ev;
+    uint64_t cnt;
+    int ret;
+
+    while (true) {
+        ret = epoll_wait(mEpollFd, &ev, 1, -1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 || !ev.data.ptr)
+            break;
+
+        Screen *sc = (Screen *)ev.data.ptr;
+
+        /* The screen may have left while the event was on its way. */
+        {
+            lock_guard<mutex> lock(mLock);
+
+            if (!mScreens.count(sc))
+                continue;
+            sc->mPoolBusy = true;
+        }
+
+        /* Reset the wakeup counter. Nothing to read is fine too. */
+        if (read(sc->mRenderEventFd, &cnt, sizeof(cnt)) < 0)
+            cnt = 0;
+
+        sc->renderStep();
+
+        {
+            lock_guard<mutex> lock(mLock);
+
+            sc->mPoolBusy = false;
+            if (mScreens.count(sc)) {
+                ev.events = EPOLLIN | EPOLLONESHOT;
+                ev.data.ptr = sc;
+                epoll_ctl(mEpollFd, EPOLL_CTL_MOD, sc->mRenderEventFd, &ev);
+            }
+        }
+
+        mIdle.notify_all();
+    }
+}
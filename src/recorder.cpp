@@ -0,0 +1,381 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+
+using namespace std;
+using namespace conutils;
+
+/*
+ * File layout, all numbers little endian:
+ *
+ * header : "conurec1", u32 version, u32 keyframe interval, i64 wall clock start in us
+ * records: a delta record per frame, times in us since the start, see delta.h
+ * trailer: u64 offset of the index record, "conuidx1"
+ *
+ * The index payload is u64 frames, u64 entries and per keyframe u64 frame, i64 time, u64 offset.
+ */
+#define REC_MAGIC     "conurec1"
+#define INDEX_MAGIC   "conuidx1"
+#define REC_VERSION   1
+#define HEADER_SIZE   24
+#define TRAILER_SIZE  16
+
+/* Buffered bytes written before the next keyframe is due. */
+#define WRITE_SIZE    (64 * 1024)
+
+static int64_t now_ns(clockid_t clock = CLOCK_MONOTONIC)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Recorder::Recorder(unsigned keyframe_interval) : mKeyframeInterval(keyframe_interval)
+{
+}
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+int Recorder::open(const char *path)
+{
+    close();
+
+    mFd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (mFd < 0)
+        return -errno;
+
+    mError = 0;
+    mOffset = 0;
+    mBuf.clear();
+    mPrev.clear();
+    mPrevBounds = Rect();
+    mIndex.clear();
+    mStats = Stats();
+    mStart = now_ns() / 1000;
+
+    mBuf.append(REC_MAGIC, 8);
+    delta_put_le(mBuf, REC_VERSION, 4);
+    delta_put_le(mBuf, mKeyframeInterval, 4);
+    delta_put_le(mBuf, now_ns(CLOCK_REALTIME) / 1000, 8);
+    return write(true);
+}
+
+int Recorder::close()
+{
+    size_t pos = mBuf.size();
+    int ret;
+
+    if (mFd < 0)
+        return 0;
+
+    if (!mError) {
+        mBuf += (char)DELTA_INDEX;
+        delta_put_le(mBuf, 16 + mIndex.size() * 24, 4);
+        mBuf.append(DELTA_HEADER_SIZE - 5, 0);
+        delta_put_le(mBuf, mStats.frames, 8);
+        delta_put_le(mBuf, mIndex.size(), 8);
+        for (const IndexEntry& e : mIndex) {
+            delta_put_le(mBuf, e.frame, 8);
+            delta_put_le(mBuf, e.time, 8);
+            delta_put_le(mBuf, e.offset, 8);
+        }
+
+        delta_put_le(mBuf, mOffset + pos, 8);
+        mBuf.append(INDEX_MAGIC, 8);
+        write(true);
+    }
+
+    ret = mError;
+    if (::close(mFd) && !ret)
+        ret = -errno;
+
+    mFd = -1;
+    mBuf.clear();
+    return ret;
+}
+
+int Recorder::write(bool all)
+{
+    size_t pos = 0;
+    ssize_t sz;
+
+    if (!all && mBuf.size() < WRITE_SIZE)
+        return 0;
+
+    while (pos < mBuf.size()) {
+        sz = ::write(mFd, mBuf.data() + pos, mBuf.size() - pos);
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            mError = -errno;
+            break;
+        }
+
+        pos += sz;
+    }
+
+    mOffset += pos;
+    mStats.bytes += pos;
+    mBuf.clear();
+    return mError;
+}
+
+int Recorder::frame(const Char *data, const Rect& bounds, const Rect& dirty)
+{
+    int64_t start = now_ns();
+    bool keyframe;
+
+    if (mFd < 0)
+        return -EBADF;
+    if (mError)
+        return mError;
+
+    keyframe = !mStats.frames || bounds != mPrevBounds ||
+               (mKeyframeInterval && mSinceKeyframe >= mKeyframeInterval);
+
+    /* Let a keyframe start where a reader seeking to it finds everything before it on disk. */
+    if (keyframe) {
+        if (write(true))
+            return mError;
+
+        mIndex.push_back({ mStats.frames, start / 1000 - mStart, mOffset });
+        mStats.keyframes++;
+        mSinceKeyframe = 0;
+    }
+
+    mStats.cells += delta_encode(mBuf, data, bounds, dirty, mPrev, mPrevBounds, keyframe, start / 1000 - mStart);
+    mStats.frames++;
+    mSinceKeyframe++;
+    write(false);
+
+    mStats.record_ns += now_ns() - start;
+    return mError;
+}
+
+Recording::~Recording()
+{
+    close();
+}
+
+int Recording::open(const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    close();
+
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &st)) {
+        ::close(fd);
+        return -errno;
+    }
+
+    if (st.st_size < HEADER_SIZE) {
+        ::close(fd);
+        return -EINVAL;
+    }
+
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    mMap = (const uint8_t *)map;
+    mSize = st.st_size;
+
+    if (memcmp(mMap, REC_MAGIC, 8) || delta_get_le(mMap + 8, 4) != REC_VERSION) {
+        close();
+        return -EINVAL;
+    }
+
+    mStartTime = delta_get_le(mMap + 16, 8);
+    return scan();
+}
+
+void Recording::close()
+{
+    if (mMap)
+        munmap((void *)mMap, mSize);
+
+    mMap = nullptr;
+    mSize = mPos = mEnd = mFrames = mFrame = 0;
+    mPosition = -1;
+    mIndex.clear();
+    mData.clear();
+    mBounds = mDirty = Rect();
+}
+
+int Recording::scan()
+{
+    const uint8_t *trailer = mMap + mSize - TRAILER_SIZE;
+    size_t pos = HEADER_SIZE;
+
+    mPos = HEADER_SIZE;
+    mFrame = 0;
+    mPosition = -1;
+
+    /* Closed recordings end with an index. */
+    if (mSize >= HEADER_SIZE + DELTA_HEADER_SIZE + 16 + TRAILER_SIZE && !memcmp(trailer + 8, INDEX_MAGIC, 8)) {
+        uint64_t offset = delta_get_le(trailer, 8);
+        const uint8_t *p = mMap + offset + DELTA_HEADER_SIZE;
+        uint64_t entries;
+
+        if (offset < HEADER_SIZE || offset > mSize - TRAILER_SIZE - DELTA_HEADER_SIZE - 16 || mMap[offset] != DELTA_INDEX)
+            return -EINVAL;
+
+        mFrames = delta_get_le(p, 8);
+        entries = delta_get_le(p + 8, 8);
+        if (entries > (mSize - offset - DELTA_HEADER_SIZE - 16 - TRAILER_SIZE) / 24)
+            return -EINVAL;
+
+        for (p += 16; entries; entries--, p += 24) {
+            mIndex.push_back({ delta_get_le(p, 8), (int64_t)delta_get_le(p + 8, 8), delta_get_le(p + 16, 8) });
+            if (mIndex.back().offset >= offset)
+                return -EINVAL;
+        }
+
+        mEnd = offset;
+        return 0;
+    }
+
+    /* Interrupted recordings are read up to their last complete frame. */
+    while (pos + DELTA_HEADER_SIZE <= mSize) {
+        uint8_t type = mMap[pos];
+        size_t len = delta_get_le(mMap + pos + 1, 4);
+
+        if ((type != DELTA_KEYFRAME && type != DELTA_FRAME) || len > mSize - pos - DELTA_HEADER_SIZE)
+            break;
+
+        if (type == DELTA_KEYFRAME)
+            mIndex.push_back({ mFrames, (int64_t)delta_get_le(mMap + pos + 5, 8), pos });
+        else if (mIndex.empty())
+            return -EINVAL;
+
+        mFrames++;
+        pos += DELTA_HEADER_SIZE + len;
+    }
+
+    mEnd = pos;
+    return 0;
+}
+
+int Recording::decode()
+{
+    size_t size = delta_record_size(mMap + mPos, mEnd - mPos);
+    int ret;
+
+    if (!size)
+        return -EINVAL;
+
+    ret = delta_decode(mMap + mPos, mData, mBounds, mDirty, mTime);
+    if (ret)
+        return ret;
+
+    mFrameBytes = size;
+    mPos += size;
+    mFrame++;
+    return 0;
+}
+
+int Recording::next()
+{
+    int ret;
+
+    if (!mMap || mPos >= mEnd)
+        return 0;
+
+    ret = decode();
+    if (ret)
+        return ret;
+
+    mPosition = mFrame - 1;
+    return 1;
+}
+
+int Recording::seek(size_t frame)
+{
+    int ret;
+
+    if (frame >= mFrames || mIndex.empty())
+        return -ERANGE;
+
+    auto it = upper_bound(mIndex.begin(), mIndex.end(), frame,
+                          [](size_t f, const IndexEntry& e) { return f < e.frame; });
+    if (it == mIndex.begin())
+        return -ERANGE;
+    it--;
+
+    mPos = it->offset;
+    mFrame = it->frame;
+    mPosition = -1;
+    while (mFrame < frame) {
+        ret = decode();
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+int Recording::seekTime(int64_t time_us)
+{
+    size_t next;
+    int ret;
+
+    auto it = upper_bound(mIndex.begin(), mIndex.end(), time_us,
+                          [](int64_t t, const IndexEntry& e) { return t < e.time; });
+    if (it == mIndex.begin())
+        return -ERANGE;
+    it--;
+
+    mPos = it->offset;
+    mFrame = it->frame;
+    mPosition = -1;
+
+    /* Decode up to the frame before the first one that is too late. */
+    while (true) {
+        next = mPos + DELTA_HEADER_SIZE + delta_get_le(mMap + mPos + 1, 4);
+        if (next + DELTA_HEADER_SIZE > mEnd || (int64_t)delta_get_le(mMap + next + 5, 8) > time_us)
+            break;
+
+        ret = decode();
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
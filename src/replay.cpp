@@ -0,0 +1,591 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+/* Default colors of the emulator. Match the Char defaults. */
+static const Attribute default_attr;
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t ns)
+{
+    struct timespec ts = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        ;
+}
+
+/* Nearest entry of the 6x6x6 color cube of the 256 color palette. */
+static uint8_t cube_color(unsigned r, unsigned g, unsigned b)
+{
+    auto level = [](unsigned v) { return v < 48 ? 0 : v < 115 ? 1 : (min(v, 255U) - 35) / 40; };
+
+    return 16 + 36 * level(r) + 6 * level(g) + level(b);
+}
+
+Replay::Replay(Screen *screen) : mScreen(screen), mSurface(screen->width(), screen->height())
+{
+    mScreen->addLayer(&mSurface);
+    reset();
+}
+
+Replay::~Replay()
+{
+    mScreen->removeLayer(&mSurface);
+}
+
+void Replay::reset()
+{
+    mState = ST_GROUND;
+    mParams.clear();
+    mSubParams.clear();
+    mCursor = mSavedCursor = Point(0, 0);
+    mWrap = false;
+    mAttr = mSavedAttr = default_attr;
+    mTop = 0;
+    mBottom = mSurface.height();
+    mLast = ' ';
+    mSyncEnd = false;
+    mBounds = Rect();
+
+    mSurface.fill(Char());
+    mDirty = Rect(0, 0, mSurface.width(), mSurface.height());
+}
+
+bool Replay::endFrame()
+{
+    size_t committed;
+
+    if (!mDirty.valid())
+        return false;
+
+    committed = mScreen->backpressureStats().frames;
+    mSurface.invalidate(mDirty);
+    mSurface.render();
+    mDirty = Rect();
+
+    mStats.frames++;
+    /* Frame pacing or a busy terminal can hold the render back. Its bytes come with a later frame. */
+    if (mScreen->backpressureStats().frames != committed)
+        mStats.output_bytes += mScreen->frameStats().bytes;
+    if (mScreen->outputFd() < 0)
+        mScreen->takeOutput();
+
+    return true;
+}
+
+int Replay::play(Recording& recording, size_t frames)
+{
+    int64_t start = now_ns(), first = -1;
+    size_t played = 0;
+    int ret;
+
+    while (!frames || played < frames) {
+        ret = recording.next();
+        if (ret <= 0) {
+            if (ret < 0)
+                return ret;
+            break;
+        }
+
+        Rect surface(0, 0, mSurface.width(), mSurface.height());
+        Rect dirty = Rect::intersect(recording.dirty(), surface);
+        const Rect& bounds = recording.bounds();
+
+        /* Cells outside a keyframe or resized frame are not in it. Blank them. */
+        if (recording.dirty() == bounds || bounds != mBounds) {
+            mSurface.fill(Char());
+            dirty = surface;
+            mBounds = bounds;
+        }
+
+        Rect copy = Rect::intersect(dirty, bounds);
+
+        for (ssize_t y = copy.top.y; copy.valid() && y < copy.bottom.y; y++) {
+            const Char *src = recording.data() + bounds.index_for(Point(copy.top.x, y));
+
+            std::copy(src, src + copy.width(), mSurface.data() + y * mSurface.width() + copy.top.x);
+        }
+
+        /* Keep the recorded timing. */
+        if (mSpeed > 0) {
+            if (first < 0)
+                first = recording.time();
+            sleep_until(start + (int64_t)((recording.time() - first) * 1000 / mSpeed));
+        }
+
+        mStats.input_bytes += recording.frameBytes();
+        mDirty = dirty;
+        endFrame();
+        played++;
+    }
+
+    mStats.elapsed_ns += now_ns() - start;
+    return played;
+}
+
+int Replay::playAnsi(const char *data, size_t len, size_t frame_bytes)
+{
+    int64_t start = now_ns();
+    size_t since = 0;
+    int played = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        since++;
+        if (feed(data[i]) || (frame_bytes && since >= frame_bytes)) {
+            played += endFrame();
+            since = 0;
+        }
+    }
+
+    played += endFrame();
+
+    mStats.input_bytes += len;
+    mStats.elapsed_ns += now_ns() - start;
+    return played;
+}
+
+unsigned Replay::param(size_t i, unsigned def) const
+{
+    return i < mParams.size() && mParams[i] ? mParams[i] : def;
+}
+
+void Replay::erase(ssize_t x0, ssize_t y0, ssize_t x1, ssize_t y1)
+{
+    Rect r = Rect::intersect(Rect(x0, y0, x1, y1), Rect(0, 0, mSurface.width(), mSurface.height()));
+
+    if (!r.valid())
+        return;
+
+    /* Erased cells take the current background color. */
+    mSurface.fill(Char(' ', mAttr.fg, mAttr.bg), r);
+    mDirty = mDirty.valid() ? Rect::boundingRect(mDirty, r) : r;
+}
+
+void Replay::scroll(ssize_t top, ssize_t bottom, ssize_t n)
+{
+    ssize_t width = mSurface.width();
+    Char *data = mSurface.data();
+
+    if (top >= bottom || !n)
+        return;
+
+    n = max(-(bottom - top), min(n, bottom - top));
+    if (n > 0) {
+        std::copy(data + (top + n) * width, data + bottom * width, data + top * width);
+        erase(0, bottom - n, width, bottom);
+    } else {
+        std::copy_backward(data + top * width, data + (bottom + n) * width, data + bottom * width);
+        erase(0, top, width, top - n);
+    }
+
+    Rect r(0, top, width, bottom);
+    mDirty = mDirty.valid() ? Rect::boundingRect(mDirty, r) : r;
+}
+
+void Replay::lineFeed()
+{
+    if (mCursor.y == mBottom - 1)
+        scroll(mTop, mBottom, 1);
+    else if (mCursor.y < (ssize_t)mSurface.height() - 1)
+        mCursor.y++;
+}
+
+void Replay::print(char c)
+{
+    ssize_t width = mSurface.width();
+    Rect r;
+
+    if (mWrap) {
+        mCursor.x = 0;
+        lineFeed();
+        mWrap = false;
+    }
+
+    mSurface.data()[mCursor.y * width + mCursor.x] = Char(c, mAttr.fg, mAttr.bg, mAttr.flags);
+    r = Rect(mCursor.x, mCursor.y, mCursor.x + 1, mCursor.y + 1);
+    mDirty = mDirty.valid() ? Rect::boundingRect(mDirty, r) : r;
+    mLast = c;
+
+    /* The cursor stays on the last column until the next glyph wraps. */
+    if (mCursor.x == width - 1)
+        mWrap = true;
+    else
+        mCursor.x++;
+}
+
+void Replay::sgr()
+{
+    if (mParams.empty()) {
+        mParams.push_back(0);
+        mSubParams.push_back(false);
+    }
+
+    for (size_t i = 0; i < mParams.size(); i++) {
+        unsigned p = mParams[i];
+        size_t end = i + 1;
+
+        /* Colon separated subparameters belong to p, e.g. 38:2::r:g:b or 4:3. */
+        while (end < mParams.size() && mSubParams[end])
+            end++;
+
+        if (end > i + 1) {
+            const unsigned *sub = &mParams[i + 1];
+            size_t subs = end - i - 1;
+            uint8_t color;
+
+            i = end - 1;
+            if (p == 4) {
+                /* Underline styles. 0 is none, the rest show as a plain underline. */
+                if (sub[0])
+                    mAttr.flags |= Attribute::underscore;
+                else
+                    mAttr.flags &= ~Attribute::underscore;
+                continue;
+            }
+
+            if (p != 38 && p != 48)
+                continue;
+
+            /* A color space id may come before r:g:b and is usually empty. */
+            if (sub[0] == 5 && subs >= 2)
+                color = sub[1];
+            else if (sub[0] == 2 && subs >= 5)
+                color = cube_color(sub[2], sub[3], sub[4]);
+            else if (sub[0] == 2 && subs == 4)
+                color = cube_color(sub[1], sub[2], sub[3]);
+            else
+                continue;
+
+            if (p == 38)
+                mAttr.fg = color;
+            else
+                mAttr.bg = color;
+            continue;
+        }
+
+        if (p == 0) {
+            mAttr = default_attr;
+        } else if (p == 1) {
+            mAttr.flags |= Attribute::bold;
+        } else if (p == 4) {
+            mAttr.flags |= Attribute::underscore;
+        } else if (p == 5) {
+            mAttr.flags |= Attribute::blink;
+        } else if (p == 7) {
+            mAttr.flags |= Attribute::reverse;
+        } else if (p == 22) {
+            mAttr.flags &= ~Attribute::bold;
+        } else if (p == 24) {
+            mAttr.flags &= ~Attribute::underscore;
+        } else if (p == 25) {
+            mAttr.flags &= ~Attribute::blink;
+        } else if (p == 27) {
+            mAttr.flags &= ~Attribute::reverse;
+        } else if (p >= 30 && p <= 37) {
+            mAttr.fg = p - 30;
+        } else if (p == 39) {
+            mAttr.fg = default_attr.fg;
+        } else if (p >= 40 && p <= 47) {
+            mAttr.bg = p - 40;
+        } else if (p == 49) {
+            mAttr.bg = default_attr.bg;
+        } else if (p >= 90 && p <= 97) {
+            mAttr.fg = p - 90 + 8;
+        } else if (p >= 100 && p <= 107) {
+            mAttr.bg = p - 100 + 8;
+        } else if ((p == 38 || p == 48) && i + 1 < mParams.size()) {
+            uint8_t color;
+
+            if (mParams[i + 1] == 5 && i + 2 < mParams.size()) {
+                color = mParams[i + 2];
+                i += 2;
+            } else if (mParams[i + 1] == 2 && i + 4 < mParams.size()) {
+                color = cube_color(mParams[i + 2], mParams[i + 3], mParams[i + 4]);
+                i += 4;
+            } else {
+                break;
+            }
+
+            if (p == 38)
+                mAttr.fg = color;
+            else
+                mAttr.bg = color;
+        }
+    }
+}
+
+void Replay::csi(char final)
+{
+    ssize_t width = mSurface.width(), height = mSurface.height();
+    ssize_t n = param(0);
+    Point& c = mCursor;
+
+    if (mIntermediate)
+        return;
+
+    if (mPrefix) {
+        /* Only the end of synchronized updates and the alternate screen matter. */
+        if (mPrefix != '?' || (final != 'h' && final != 'l'))
+            return;
+
+        for (unsigned mode : mParams) {
+            if (mode == 2026 && final == 'l')
+                mSyncEnd = true;
+            else if (mode == 47 || mode == 1047 || mode == 1049)
+                erase(0, 0, width, height);
+        }
+        return;
+    }
+
+    switch (final) {
+    case 'A':
+        c.y = max(c.y - n, c.y >= mTop ? mTop : (ssize_t)0);
+        break;
+    case 'B':
+    case 'e':
+        c.y = min(c.y + n, c.y < mBottom ? mBottom - 1 : height - 1);
+        break;
+    case 'C':
+    case 'a':
+        c.x = min(c.x + n, width - 1);
+        break;
+    case 'D':
+        c.x = max(c.x - n, (ssize_t)0);
+        break;
+    case 'E':
+        c.x = 0;
+        c.y = min(c.y + n, c.y < mBottom ? mBottom - 1 : height - 1);
+        break;
+    case 'F':
+        c.x = 0;
+        c.y = max(c.y - n, c.y >= mTop ? mTop : (ssize_t)0);
+        break;
+    case 'G':
+    case '`':
+        c.x = min(n - 1, width - 1);
+        break;
+    case 'd':
+        c.y = min(n - 1, height - 1);
+        break;
+    case 'H':
+    case 'f':
+        c.y = min((ssize_t)param(0) - 1, height - 1);
+        c.x = min((ssize_t)param(1) - 1, width - 1);
+        break;
+    case 'J':
+        n = param(0, 0);
+        if (n == 0) {
+            erase(c.x, c.y, width, c.y + 1);
+            erase(0, c.y + 1, width, height);
+        } else if (n == 1) {
+            erase(0, 0, width, c.y);
+            erase(0, c.y, c.x + 1, c.y + 1);
+        } else {
+            erase(0, 0, width, height);
+        }
+        break;
+    case 'K':
+        n = param(0, 0);
+        erase(n == 0 ? c.x : 0, c.y, n == 1 ? c.x + 1 : width, c.y + 1);
+        break;
+    case 'X':
+        erase(c.x, c.y, c.x + n, c.y + 1);
+        break;
+    case 'b':
+        for (ssize_t i = 0; i < n && i < width * height; i++)
+            print(mLast);
+        return;
+    case 'm':
+        sgr();
+        return;
+    case 'r':
+        mTop = min((ssize_t)param(0) - 1, height - 1);
+        mBottom = min((ssize_t)param(1, height), height);
+        if (mTop >= mBottom) {
+            mTop = 0;
+            mBottom = height;
+        }
+        c = Point(0, 0);
+        break;
+    case 'S':
+        scroll(mTop, mBottom, n);
+        break;
+    case 'T':
+        scroll(mTop, mBottom, -n);
+        break;
+    case 'L':
+    case 'M':
+        if (c.y >= mTop && c.y < mBottom)
+            scroll(c.y, mBottom, final == 'M' ? n : -n);
+        c.x = 0;
+        break;
+    case 'P':
+    case '@': {
+        Char *row = mSurface.data() + c.y * width;
+
+        n = min(n, width - c.x);
+        if (final == 'P') {
+            std::copy(row + c.x + n, row + width, row + c.x);
+            erase(width - n, c.y, width, c.y + 1);
+        } else {
+            std::copy_backward(row + c.x, row + width - n, row + width);
+            erase(c.x, c.y, c.x + n, c.y + 1);
+        }
+        mDirty = Rect::boundingRect(mDirty, Rect(c.x, c.y, width, c.y + 1));
+        break;
+    }
+    case 's':
+        mSavedCursor = c;
+        break;
+    case 'u':
+        c = mSavedCursor;
+        break;
+    default:
+        return;
+    }
+
+    mWrap = false;
+}
+
+bool Replay::feed(char ch)
+{
+    uint8_t c = ch;
+
+    switch (mState) {
+    case ST_ESC:
+        mState = ST_GROUND;
+        if (c == '[') {
+            mState = ST_CSI;
+            mParams.clear();
+            mSubParams.clear();
+            mPrefix = 0;
+            mIntermediate = false;
+        } else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+            mState = ST_STRING;
+        } else if (c == '(' || c == ')' || c == '*' || c == '+' || c == '#' || c == '%') {
+            mState = ST_CHARSET;
+        } else if (c == '7') {
+            mSavedCursor = mCursor;
+            mSavedAttr = mAttr;
+        } else if (c == '8') {
+            mCursor = mSavedCursor;
+            mAttr = mSavedAttr;
+            mWrap = false;
+        } else if (c == 'D' || c == 'E') {
+            if (c == 'E')
+                mCursor.x = 0;
+            lineFeed();
+            mWrap = false;
+        } else if (c == 'M') {
+            if (mCursor.y == mTop)
+                scroll(mTop, mBottom, -1);
+            else if (mCursor.y > 0)
+                mCursor.y--;
+            mWrap = false;
+        } else if (c == 'c') {
+            reset();
+        } else if (c == 0x1b) {
+            mState = ST_ESC;
+        }
+        return false;
+
+    case ST_CSI:
+        if (c >= '0' && c <= '9') {
+            if (mParams.empty()) {
+                mParams.push_back(0);
+                mSubParams.push_back(false);
+            }
+            mParams.back() = min(mParams.back() * 10 + (c - '0'), 65535U);
+        } else if (c == ';' || c == ':') {
+            if (mParams.empty()) {
+                mParams.push_back(0);
+                mSubParams.push_back(false);
+            }
+            mParams.push_back(0);
+            mSubParams.push_back(c == ':');
+        } else if (c >= '<' && c <= '?') {
+            mPrefix = c;
+        } else if (c >= 0x20 && c <= 0x2f) {
+            mIntermediate = true;
+        } else if (c >= 0x40 && c <= 0x7e) {
+            mState = ST_GROUND;
+            mSyncEnd = false;
+            csi(c);
+            return mSyncEnd;
+        } else if (c == 0x1b) {
+            mState = ST_ESC;
+        } else if (c == 0x18 || c == 0x1a) {
+            mState = ST_GROUND;
+        }
+        return false;
+
+    case ST_STRING:
+        if (c == 0x07 || c == 0x18 || c == 0x1a)
+            mState = ST_GROUND;
+        else if (c == 0x1b)
+            mState = ST_STRING_ESC;
+        return false;
+
+    case ST_STRING_ESC:
+        mState = c == '\\' ? ST_GROUND : ST_STRING;
+        return false;
+
+    case ST_CHARSET:
+        mState = ST_GROUND;
+        return false;
+    }
+
+    if (c >= 0x20 && c < 0x7f) {
+        print(c);
+    } else if (c >= 0xc0) {
+        /* Lead byte of a multibyte character. Its continuation bytes are skipped. */
+        print('?');
+    } else if (c == '\r') {
+        mCursor.x = 0;
+        mWrap = false;
+    } else if (c == '\n' || c == '\v' || c == '\f') {
+        lineFeed();
+        mWrap = false;
+    } else if (c == '\b') {
+        mCursor.x = max(mCursor.x - 1, (ssize_t)0);
+        mWrap = false;
+    } else if (c == '\t') {
+        mCursor.x = min((mCursor.x / 8 + 1) * 8, (ssize_t)mSurface.width() - 1);
+    } else if (c == 0x1b) {
+        mState = ST_ESC;
+    }
+
+    return false;
+}
@@ -17,22 +17,268 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <iostream>
+#include <algorithm>
+#include <cmath>
 
 #include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/stat.h>
 
 #include "conutils.h"
+#include "encoder.h"
+#include "format.h"
 
 using namespace std;
 using namespace conutils;
 
-static int query_screen_size(size_t& width, size_t& height)
+constexpr uint8_t palette16::map[256];
+constexpr uint8_t palette16::sgr[16];
+
+/* @return Number of decimal digits in num. */
+static inline size_t num_len(size_t num)
+{
+    size_t len = 1;
+
+    while (num >= 10) {
+        num /= 10;
+        len++;
+    }
+
+    return len;
+}
+
+/* @return Bytes needed for a relative cursor movement of n cells (ESC [ n C). */
+static inline size_t rel_cost(size_t n)
+{
+    if (!n)
+        return 0;
+
+    /* Count of 1 is the default and can be omitted. */
+    return n == 1 ? 3 : 3 + num_len(n);
+}
+
+/* @return Bytes needed for an absolute cursor movement to 0 based pos (ESC [ y ; x H). */
+static inline size_t cup_cost(const Point& pos)
+{
+    if (!pos.x)
+        return pos.y ? 3 + num_len(pos.y + 1) : 3;
+
+    return 4 + num_len(pos.y + 1) + num_len(pos.x + 1);
+}
+
+/* Attribute flags that are displayed with SGR. */
+#define SGR_FLAGS (Attribute::bold | Attribute::underscore | Attribute::blink | Attribute::reverse)
+
+/* SGR parameters to set and reset each attribute flag. */
+struct sgr_flag {
+    uint8_t flag;
+    uint8_t on;
+    uint8_t off;
+};
+
+static const sgr_flag sgr_flags[] = {
+    { Attribute::bold,       1, 22 },
+    { Attribute::underscore, 4, 24 },
+    { Attribute::blink,      5, 25 },
+    { Attribute::reverse,    7, 27 },
+};
+
+/* Parameters of a single SGR sequence. */
+struct sgr_params {
+    uint8_t p[12];
+    size_t count = 0;
+
+    inline void push(uint8_t v) { p[count++] = v; }
+    inline void push(uint8_t v1, uint8_t v2, uint8_t v3) { push(v1); push(v2); push(v3); }
+
+    /* @return Length of the parameters string including separators. */
+    size_t len() const
+    {
+        size_t l = count ? count - 1 : 0;
+
+        for (size_t i = 0; i < count; i++)
+            l += num_len(p[i]);
+
+        return l;
+    }
+};
+
+/* @return true if both attributes look the same on the terminal. */
+static inline bool sgr_equal(const Attribute& a1, const Attribute& a2)
+{
+    return a1.fg == a2.fg && a1.bg == a2.bg && !((a1.flags ^ a2.flags) & SGR_FLAGS);
+}
+
+/*
+ * Marks characters of the last frame that are not known.
+ * Transparent characters never reach the screen buffer,
+ * so this will never match anything rendered.
+ */
+static const Char unknown_char(0, 0, 0, Attribute::transparent);
+
+/* Number of entries in the SGR transitions cache. Must be a power of 2. */
+#define SGR_CACHE_SIZE 512
+
+/* @return SGR cache key for transition from (valid) cur to attr in an SGR dialect. Never 0. */
+static inline uint64_t sgr_key(unsigned dialect, bool valid, const Attribute& cur, const Attribute& attr)
+{
+    uint64_t key = 1ull << 63 | (uint64_t)dialect << 56;
+
+    if (valid)
+        key |= 1ull << 62 | (uint64_t)cur.fg << 40 | (uint64_t)cur.bg << 32 | (uint64_t)(cur.flags & SGR_FLAGS) << 24;
+
+    return key | (uint64_t)attr.fg << 16 | (uint64_t)attr.bg << 8 | (attr.flags & SGR_FLAGS);
+}
+
+/* @return SGR cache slot for key. */
+static inline size_t sgr_slot(uint64_t key)
+{
+    key *= 0x9e3779b97f4a7c15ull;
+    return (key >> 32) & (SGR_CACHE_SIZE - 1);
+}
+
+/* @return Bytes needed to repeat the preceding character n times (ESC [ n b). */
+static inline size_t rep_cost(size_t n)
+{
+    return n == 1 ? 3 : 3 + num_len(n);
+}
+
+/* @return Bytes needed to erase n characters (ESC [ n X). */
+static inline size_t ech_cost(size_t n)
+{
+    return n == 1 ? 3 : 3 + num_len(n);
+}
+
+/* @return true if ch looks like a cell that was erased with its background color. */
+static inline bool is_blank(const Char& ch)
+{
+    return (ch.val == ' ' || !isprint(ch.val)) && !(ch.attr.flags & (Attribute::underscore | Attribute::reverse));
+}
+
+/* @return FNV-1a hash of a row of characters. */
+static uint64_t row_hash(const Char *row, size_t width)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(row);
+    const uint8_t *end = reinterpret_cast<const uint8_t *>(row + width);
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    while (p < end) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+/* @return Monotonic time in microseconds. */
+static int64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Triple buffer slot index and flag for a slot the render thread did not take yet. */
+#define SLOT_INDEX 0x03
+#define SLOT_FRESH 0x04
+
+/* Commands for the render thread. */
+enum {
+    CMD_CLEAR      = 0x01,
+    CMD_CURSOR     = 0x02,
+    CMD_CURSOR_POS = 0x04,
+};
+
+/* Capabilities the encoder uses. The others are only reported in the profile. */
+#define ENCODER_CAPS (Screen::CAP_REP | Screen::CAP_ERASE | Screen::CAP_SCROLL | Screen::CAP_SYNC)
+
+/* Encoder variant of a family for the capabilities c. Variants of capabilities the family lacks are the same. */
+#define ENCODER_VARIANT(Family, Palette, c) &Screen::encode<conutils::encoder<Family, Palette, ((c) & Family::caps)>>
+
+template <class Family, class Palette>
+const Screen::EncodeFn *Screen::encoders()
+{
+    static_assert(ENCODER_CAPS == 0x0f, "One variant per combination of encoder capabilities");
+
+    static const EncodeFn variants[] = {
+        ENCODER_VARIANT(Family, Palette, 0x00), ENCODER_VARIANT(Family, Palette, 0x01),
+        ENCODER_VARIANT(Family, Palette, 0x02), ENCODER_VARIANT(Family, Palette, 0x03),
+        ENCODER_VARIANT(Family, Palette, 0x04), ENCODER_VARIANT(Family, Palette, 0x05),
+        ENCODER_VARIANT(Family, Palette, 0x06), ENCODER_VARIANT(Family, Palette, 0x07),
+        ENCODER_VARIANT(Family, Palette, 0x08), ENCODER_VARIANT(Family, Palette, 0x09),
+        ENCODER_VARIANT(Family, Palette, 0x0a), ENCODER_VARIANT(Family, Palette, 0x0b),
+        ENCODER_VARIANT(Family, Palette, 0x0c), ENCODER_VARIANT(Family, Palette, 0x0d),
+        ENCODER_VARIANT(Family, Palette, 0x0e), ENCODER_VARIANT(Family, Palette, 0x0f),
+    };
+
+    return variants;
+}
+
+/* Adaptive quality measurement period, pace of degrading and how long the backlog stays small before restoring. */
+#define ADAPT_SAMPLE_US   250000
+#define ADAPT_DEGRADE_US  500000
+#define ADAPT_RESTORE_US  2000000
+/* Damage held back at ADAPT_PRIORITY is committed this often. */
+#define ADAPT_HELD_US     1000000
+
+/* Frame rate limit and colors of each adaptive quality level. */
+static const struct adapt_level {
+    unsigned fps;
+    unsigned colors;
+} adapt_levels[] = {
+    {  0, 256 },
+    { 20, 256 },
+    { 20,  16 },
+    { 10,   0 },
+    { 10,   0 },
+};
+
+/* @return Bytes queued for the other end of fd. Terminals and sockets report their output queue, pipes what is unread. */
+static size_t queued_bytes(int fd)
+{
+    int n = 0;
+
+    if (ioctl(fd, TIOCOUTQ, &n) && ioctl(fd, FIONREAD, &n))
+        return 0;
+
+    return n > 0 ? n : 0;
+}
+
+/* @return Encoder family for a terminal type. */
+static Screen::Encoder encoder_for_term(const string& term)
+{
+    if (!term.compare(0, 5, "linux"))
+        return Screen::ENCODER_LINUX;
+
+    if (!term.compare(0, 5, "vt100") || !term.compare(0, 5, "vt102"))
+        return Screen::ENCODER_VT100;
+
+    return Screen::ENCODER_XTERM;
+}
+
+static int query_screen_size(int fd, size_t& width, size_t& height)
 {
     struct winsize w;
-    int ret = ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    int ret = ioctl(fd, TIOCGWINSZ, &w);
 
     if (!ret) {
         width = w.ws_col;
@@ -42,11 +288,32 @@ static int query_screen_size(size_t& width, size_t& height)
     return ret;
 }
 
+Screen::Screen(size_t width, size_t height, int fd, int in_fd)
+    : Surface(width, height), mFd(fd), mInFd(in_fd), mEncoders(encoders<xterm_family, palette256>()),
+      mSgrCache(SGR_CACHE_SIZE)
+{
+    mBounds = {0, 0, (ssize_t)width, (ssize_t)height};
+    invalidateFront();
+    hideCursor();
+}
+
 Screen::~Screen()
 {
+    stopRenderThread();
+
+    /* The writer refers to the output buffer until the write completes. */
+    if (mWriter) {
+        while (mWriteInFlight && mWriter->process(-1) >= 0)
+            ;
+        mWriter = nullptr;
+    }
+
+    if (mNonBlocking)
+        setNonBlocking(false);
     clear();
     showCursor();
     close(mWinchFd);
+    unexportFramebuffer();
 }
 
 Screen *Screen::getInstance()
@@ -59,14 +326,18 @@ Screen *Screen::getInstance()
     if (instance)
         return instance.get();
 
-    if (query_screen_size(width, height))
+    if (query_screen_size(STDOUT_FILENO, width, height))
         return nullptr;
 
-    instance = unique_ptr<Screen>(new Screen(width, height));
+    instance = unique_ptr<Screen>(new Screen(width, height, STDOUT_FILENO, STDIN_FILENO));
     sc = instance.get();
     if (!sc)
         return nullptr;
 
+    if (getenv("TERM"))
+        sc->mTerm = getenv("TERM");
+    sc->setEncoder(encoder_for_term(sc->mTerm));
+
     sigemptyset(&mask);
     sigaddset(&mask, SIGWINCH);
 
@@ -80,23 +351,177 @@ Screen *Screen::getInstance()
     return sc;
 }
 
+unique_ptr<Screen> Screen::createHeadless(size_t width, size_t height, int fd)
+{
+    return unique_ptr<Screen>(new Screen(width, height, fd < 0 ? -1 : fd, -1));
+}
+
+unique_ptr<Screen> Screen::create(int fd, const char *term)
+{
+    unique_ptr<Screen> sc;
+    size_t width, height;
+
+    if (fd < 0 || query_screen_size(fd, width, height))
+        return nullptr;
+
+    sc = unique_ptr<Screen>(new Screen(width, height, fd, fd));
+    if (!term)
+        term = getenv("TERM");
+    if (term)
+        sc->mTerm = term;
+    sc->setEncoder(encoder_for_term(sc->mTerm));
+
+    return sc;
+}
+
 int Screen::resize()
 {
     size_t width, height;
     int ret;
 
-    ret = query_screen_size(width, height);
+    ret = query_screen_size(mFd, width, height);
     if (ret)
         return ret;
 
+    return resize(width, height);
+}
+
+/* Ends an update of an exported screen that is not mapped anymore. */
+static void end_framebuffer_update(int fd)
+{
+    void *map = mmap(nullptr, sizeof(FramebufferHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    FramebufferHeader *hdr = (FramebufferHeader *)map;
+
+    if (map == MAP_FAILED)
+        return;
+
+    if (hdr->seq.load(memory_order_relaxed) & 1)
+        hdr->seq.fetch_add(1, memory_order_release);
+    munmap(map, sizeof(FramebufferHeader));
+}
+
+int Screen::resize(size_t width, size_t height)
+{
+    int ret;
+
+    /* The old mapping goes with the old buffer. The new one continues the sequence. */
+    if (mExport) {
+        renderBegin(mBounds);
+        mExport = nullptr;
+    }
+
+    /* On failure the export keeps the last frame. Do not leave readers waiting for the next. */
     ret = Surface::resize(width, height);
-    if (ret)
+    if (ret) {
+        if (mExportFd >= 0)
+            end_framebuffer_update(mExportFd);
         return ret;
+    }
+
+    if (mExportFd >= 0) {
+        ret = mapFramebuffer();
+        if (ret)
+            end_framebuffer_update(mExportFd);
+    }
 
     mBounds = {0, 0, (ssize_t)width, (ssize_t)height};
+
+    /* The render thread notices the new bounds with the next snapshot. */
+    if (renderThreadRunning())
+        return ret;
+
+    invalidateFront();
+    /* Merged damage is out of date. The whole screen is dirty anyway. */
+    mDeferred = Rect();
+    mDeferredFrames = 0;
+    mDeferredCollect = mDeferredCompose = 0;
+    return ret;
+}
+
+int Screen::exportFramebuffer(const char *name)
+{
+    int ret;
+
+    if (mExportFd >= 0)
+        return -EBUSY;
+
+    if (name)
+        mExportFd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    else
+        mExportFd = memfd_create("conutils-screen", MFD_CLOEXEC);
+    if (mExportFd < 0)
+        return -errno;
+
+    mExportName = name ? name : "";
+    mExportSize = 0;
+
+    ret = mapFramebuffer();
+    if (ret) {
+        unexportFramebuffer();
+        return ret;
+    }
+
+    return mExportFd;
+}
+
+int Screen::mapFramebuffer()
+{
+    size_t offset = (sizeof(FramebufferHeader) + 63) & ~63;
+    size_t size = offset + Surface::size() * sizeof(Char);
+    FramebufferHeader *hdr;
+    uint64_t seq;
+    void *map;
+
+    /* Readers may map all of it. Never shrink. */
+    size = max(size, mExportSize);
+    if (size > mExportSize && ftruncate(mExportFd, size))
+        return -errno;
+
+    map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, mExportFd, 0);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    hdr = (FramebufferHeader *)map;
+    seq = hdr->seq.load(memory_order_relaxed) | 1;
+    hdr->seq.store(seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(hdr->magic, "conufb1", sizeof(hdr->magic));
+    hdr->size = size;
+    hdr->offset = offset;
+    hdr->cell_size = sizeof(Char);
+    hdr->width = width();
+    hdr->height = height();
+    hdr->dirty_left = hdr->dirty_top = 0;
+    hdr->dirty_right = width();
+    hdr->dirty_bottom = height();
+
+    setBuffer((Char *)((char *)map + offset), [map, size](Char *) { munmap(map, size); });
+
+    mExport = hdr;
+    mExportSize = size;
+    hdr->seq.store(seq + 1, memory_order_release);
     return 0;
 }
 
+void Screen::unexportFramebuffer()
+{
+    if (mExportFd < 0)
+        return;
+
+    if (mExport)
+        setBuffer(new Char[Surface::size()], [](Char *data) { delete[] data; });
+
+    close(mExportFd);
+    if (!mExportName.empty())
+        shm_unlink(mExportName.c_str());
+
+    mExportFd = -1;
+    mExportName.clear();
+    mExport = nullptr;
+    mExportSize = 0;
+}
+
 int Screen::wait_sigwinch(Rect& new_bounds)
 {
     struct signalfd_siginfo fdsi;
@@ -108,7 +533,7 @@ int Screen::wait_sigwinch(Rect& new_bounds)
     if (sz != sizeof(struct signalfd_siginfo))
         return -EIO;
 
-    ret = query_screen_size(width, height);
+    ret = query_screen_size(mFd, width, height);
     if (ret)
         return -EIO;
 
@@ -116,97 +541,1811 @@ int Screen::wait_sigwinch(Rect& new_bounds)
     return 0;
 }
 
-void Screen::clear()
+int Screen::sizeChanged(Rect& new_bounds)
 {
-    cout << "\x1b[0m\x1b[2J\x1b[1;1H";
-    cout.flush();
-    invalidate();
+    size_t width, height;
+
+    if (query_screen_size(mFd, width, height))
+        return -errno;
+
+    if (width == this->width() && height == this->height())
+        return 0;
+
+    new_bounds = {0, 0, (ssize_t)width, (ssize_t)height};
+    return 1;
 }
 
-void Screen::showCursor()
+void Screen::putNum(size_t num)
 {
-    cout << "\x1b[?25h";
-    cout.flush();
-    mCursorVisible = true;
+    format_num(mOut, num);
 }
 
-void Screen::hideCursor()
+void Screen::putParam(uint8_t num)
 {
-    cout << "\x1b[?25l";
-    cout.flush();
-    mCursorVisible = false;
+    format_u8(mOut, num);
 }
 
-void Screen::setCursorPos(const Point& pos)
+int Screen::flush(FrameStats *stats)
+{
+    struct pollfd pfd = { mFd, POLLOUT, 0 };
+    int64_t start = 0;
+    ssize_t sz;
+    int ret = 0;
+
+    fanOut();
+
+    if (mWriter)
+        return submit();
+
+    /* Memory backed screen. */
+    if (mFd < 0) {
+        lock_guard<mutex> lock(mSinkLock);
+
+        if (stats)
+            stats->bytes += mOut.size() - mOutPos;
+
+        mSink.append(mOut, mOutPos, string::npos);
+        mOut.clear();
+        mOutPos = mMirrorPos = 0;
+        return 0;
+    }
+
+    if (stats && mOutPos < mOut.size())
+        start = now_ns();
+
+    while (mOutPos < mOut.size()) {
+        sz = write(mFd, mOut.data() + mOutPos, mOut.size() - mOutPos);
+        if (stats)
+            stats->syscalls++;
+
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN) {
+                /* Keep the rest for later. */
+                if (mNonBlocking) {
+                    mBackpressure.stalls++;
+                    if (stats)
+                        stats->write_ns += now_ns() - start;
+                    return -EAGAIN;
+                }
+
+                /* Terminal is full. Wait for it to drain. */
+                if (poll(&pfd, 1, -1) >= 0)
+                    continue;
+            }
+
+            ret = -errno;
+            break;
+        }
+
+        if (stats)
+            stats->bytes += sz;
+
+        mOutPos += sz;
+        mWritten += sz;
+    }
+
+    if (start)
+        stats->write_ns += now_ns() - start;
+
+    mOut.clear();
+    mOutPos = mMirrorPos = 0;
+    return ret;
+}
+
+string Screen::takeOutput()
 {
-    cout << "\x1b[" << pos.y << ";" << pos.x << "H";
-    cout.flush();
+    lock_guard<mutex> lock(mSinkLock);
+    string out;
+
+    out.swap(mSink);
+    return out;
 }
 
-/* TODO: add support for extended characters. */
-void Screen::drawChar(const Char& ch)
+int Screen::submit()
+{
+    int ret;
+
+    /* One write at a time. Output put meanwhile follows once it completes. */
+    if (mWriteInFlight)
+        return -EAGAIN;
+
+    mOut.erase(0, mOutPos);
+    mOutPos = mMirrorPos = 0;
+    if (mOut.empty())
+        return 0;
+
+    /* Keep the queued data away from the output buffer that frames are encoded into. */
+    mWriting.swap(mOut);
+    mOut.clear();
+
+    ret = mWriter->write(mFd, mWriting.data(), mWriting.size(), [this](ssize_t result) { writeDone(result); });
+    if (ret) {
+        mWriting.swap(mOut);
+        mMirrorPos = mOut.size();
+        return ret;
+    }
+
+    mWriteInFlight = true;
+    return -EAGAIN;
+}
+
+void Screen::fanOut()
+{
+    if (mMirrors.empty() || mMirrorPos >= mOut.size())
+        return;
+
+    /* Lagging mirrors skip this and catch up later. */
+    for (Mirror& m : mMirrors) {
+        if (m.synced && !m.error)
+            m.out.append(mOut, mMirrorPos, string::npos);
+    }
+
+    mMirrorPos = mOut.size();
+    writeMirrors();
+}
+
+void Screen::writeMirrors()
 {
-    bool attr_changed = false;
+    ssize_t sz;
+
+    for (Mirror& m : mMirrors) {
+        while (!m.error && m.pos < m.out.size()) {
+            sz = write(m.fd, m.out.data() + m.pos, m.out.size() - m.pos);
+            if (sz < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    m.error = -errno;
+                break;
+            }
+
+            m.pos += sz;
+        }
+
+        if (m.error || m.pos == m.out.size()) {
+            m.out.clear();
+            m.pos = 0;
+        }
+    }
+}
 
-    if (ch.attr != mCurrentAttr.attr || !mCurrentAttr.val) {
-        /* Terminal attributes has changed. We must issue a reset. */
-        cout << "\x1b[0m";
+void Screen::catchUp(Mirror& m)
+{
+    const Char *frame = mFrame;
+    Rect frame_bounds = mFrameBounds;
+    FrameStats stats = mFrameStats;
+    vector<Char> target = mFront;
 
-        if (ch.attr.flags & Attribute::bold)
-            cout << "\x1b[1m";
-        if (ch.attr.flags & Attribute::underscore)
-            cout << "\x1b[4m";
-        if (ch.attr.flags & Attribute::blink)
-            cout << "\x1b[5m";
-        if (ch.attr.flags & Attribute::reverse)
-            cout << "\x1b[7m";
-        attr_changed = true;
+    if (m.frontBounds != mFrontBounds) {
+        m.front.assign(mFrontBounds.size(), unknown_char);
+        m.frontBounds = mFrontBounds;
     }
 
-    if (attr_changed || (ch.attr.fg != mCurrentAttr.attr.fg)) {
-        cout << "\x1b[38;5;" << (int)ch.attr.fg << "m";
-        attr_changed = true;
+    /* The screen repaints cells it does not know before relying on them. So may the mirror. */
+    for (size_t i = 0; i < target.size(); i++) {
+        if (target[i] == unknown_char)
+            m.front[i] = unknown_char;
     }
 
-    if (attr_changed || (ch.attr.bg != mCurrentAttr.attr.bg)) {
-        cout << "\x1b[48;5;" << (int)ch.attr.bg << "m";
-        attr_changed = true;
+    if (m.fresh) {
+        m.out += "\x1b[0m\x1b[2J";
+        m.fresh = false;
     }
+    m.out += mCursorVisible ? "\x1b[?25h" : "\x1b[?25l";
 
-    if (attr_changed)
-        mCurrentAttr = ch;
+    /* Encode the difference to what the mirror shows into its own buffer. */
+    mFront.swap(m.front);
+    mOut.swap(m.out);
+    mFrame = target.data();
+    mFrameBounds = mFrontBounds;
 
-    /* Display only printable characters to not mess up the layout. */
-    if (isprint(ch.val))
-        cout << ch.val;
-    else
-        cout << ' ';
+    encodeFrame(mFrameBounds);
+
+    mFront.swap(m.front);
+    mOut.swap(m.out);
+    mFrame = frame;
+    mFrameBounds = frame_bounds;
+    mFrameStats = stats;
+    m.synced = true;
 }
 
-void Screen::renderDone(const Rect& dirty)
+void Screen::flushMirrors()
 {
-    /* ANSI terminal coordinates starts from 1. */
-    size_t x = dirty.top.x + 1;
-    size_t y = dirty.top.y + 1;
-    size_t x_cnt = x + dirty.width();
-    size_t y_cnt = y + dirty.height();
-    const Char *buf = data();
-    size_t offset = 0;
+    bool caught_up = false;
+
+    /* Catching up covers the output so far. Nothing of it may follow. */
+    fanOut();
+    writeMirrors();
+
+    for (Mirror& m : mMirrors) {
+        if (!m.synced && !m.error && m.out.empty()) {
+            catchUp(m);
+            caught_up = true;
+        }
+    }
 
-    /* Invalidate current attributes. */
-    mCurrentAttr = Char(0, 0, 0, 0);
+    if (caught_up)
+        writeMirrors();
+}
+
+int Screen::addMirror(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (renderThreadRunning())
+        return -EBUSY;
+
+    if (flags < 0)
+        return -errno;
+
+    for (const Mirror& m : mMirrors) {
+        if (m.fd == fd)
+            return -EEXIST;
+    }
+
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+        return -errno;
 
-    /* Update only the dirty region. */
-    for (; y < y_cnt; y++) {
-        x = dirty.top.x + 1;
-        /* conutils coordinates start from 0. */
-        offset = mBounds.index_for(Point(x - 1, y - 1));
-        /* Goto x, y */
-        cout << "\x1b[" << y << ";" << x << "H";
-        for (; x < x_cnt; x++) {
-            drawChar(buf[offset++]);
+    /* Output put so far is not for the new mirror. */
+    fanOut();
+
+    mMirrors.emplace_back();
+    mMirrors.back().fd = fd;
+    flushMirrors();
+    return 0;
+}
+
+int Screen::removeMirror(int fd)
+{
+    for (auto it = mMirrors.begin(); it != mMirrors.end(); it++) {
+        if (it->fd == fd) {
+            mMirrors.erase(it);
+            return 0;
         }
     }
 
-    cout.flush();
+    return -ENOENT;
+}
+
+vector<int> Screen::mirrorFds() const
+{
+    vector<int> fds;
+
+    for (const Mirror& m : mMirrors) {
+        if (!m.error && (!m.out.empty() || !m.synced))
+            fds.push_back(m.fd);
+    }
+
+    return fds;
+}
+
+void Screen::writeDone(ssize_t result)
+{
+    mWriteInFlight = false;
+    mWriting.clear();
+
+    /* Whatever reached the terminal is unknown. Repaint what is rendered next. */
+    if (result < 0) {
+        invalidateFront();
+    } else {
+        mFrameStats.bytes += result;
+        mWritten += result;
+    }
+
+    /* Queue output put meanwhile and merged damage that is due. */
+    flushPending();
+}
+
+int Screen::setWriter(AsyncWriter *writer)
+{
+    int ret;
+
+    if (renderThreadRunning() || mWriteInFlight)
+        return -EBUSY;
+
+    /* The poll() fallback of the writer needs non-blocking output. */
+    if (writer && !mNonBlocking) {
+        ret = setNonBlocking(true);
+        if (ret)
+            return ret;
+    }
+
+    mWriter = writer;
+    return 0;
+}
+
+int Screen::setRecorder(Recorder *recorder)
+{
+    if (renderThreadRunning())
+        return -EBUSY;
+
+    mRecorder = recorder;
+    return 0;
+}
+
+int Screen::setStreamServer(StreamServer *server)
+{
+    if (renderThreadRunning())
+        return -EBUSY;
+
+    /* Memory backed screens do not encode while streaming. */
+    if (mFd < 0)
+        invalidateFront();
+
+    mStream = server;
+    return 0;
+}
+
+int Screen::setNonBlocking(bool enable)
+{
+    int flags = fcntl(mFd, F_GETFL);
+
+    if (renderThreadRunning() || (mWriter && !enable))
+        return -EBUSY;
+
+    if (flags < 0)
+        return -errno;
+
+    flags = enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    if (fcntl(mFd, F_SETFL, flags))
+        return -errno;
+
+    mNonBlocking = enable;
+
+    /* Blocking mode does not keep anything pending. */
+    return enable ? 0 : flushPending();
+}
+
+bool Screen::pending() const
+{
+    if (renderThreadRunning())
+        return false;
+
+    if (mOutPos < mOut.size() || mDeferred.valid() || mWriteInFlight)
+        return true;
+
+    for (const Mirror& m : mMirrors) {
+        if (!m.error && (!m.out.empty() || !m.synced))
+            return true;
+    }
+
+    return false;
+}
+
+int Screen::flushPending()
+{
+    int ret;
+
+    if (renderThreadRunning())
+        return 0;
+
+    mFrame = data();
+    mFrameBounds = mBounds;
+    ret = commit();
+    flushMirrors();
+    return ret;
+}
+
+void Screen::setFrameRate(unsigned fps)
+{
+    mFrameInterval = fps ? 1000000 / fps : 0;
+}
+
+int64_t Screen::frameInterval() const
+{
+    return max(mFrameInterval.load(), mAdaptInterval);
+}
+
+int Screen::setAdaptive(unsigned latency_ms)
+{
+    if (renderThreadRunning())
+        return -EBUSY;
+
+    if (mFd < 0)
+        return -EINVAL;
+
+    mAdaptTarget = (int64_t)latency_ms * 1000;
+    mAdaptSample = mAdaptChange = mAdaptCalm = 0;
+    if (!mAdaptTarget && mAdaptive.level != ADAPT_FULL)
+        setAdaptiveLevel(ADAPT_FULL);
+
+    return 0;
+}
+
+int Screen::setLayerPriority(Surface *sf, bool priority)
+{
+    auto it = find(mPriority.begin(), mPriority.end(), sf);
+
+    if (!sf)
+        return -EINVAL;
+
+    if (priority && it == mPriority.end())
+        mPriority.push_back(sf);
+    else if (!priority && it != mPriority.end())
+        mPriority.erase(it);
+
+    /* Nothing to prioritize anymore. */
+    if (mPriority.empty() && mAdaptive.level == ADAPT_PRIORITY)
+        setAdaptiveLevel(ADAPT_MONO);
+
+    return 0;
+}
+
+void Screen::setAdaptiveLevel(unsigned level)
+{
+    unsigned colors = mAdaptive.colors;
+    Rect damage;
+
+    mAdaptive.level = level;
+    mAdaptive.fps = adapt_levels[level].fps;
+    mAdaptInterval = mAdaptive.fps ? 1000000 / mAdaptive.fps : 0;
+    selectEncoders();
+
+    /* Cells drawn with fewer colors stay that way until they are repainted. */
+    if (mAdaptive.colors > colors) {
+        invalidateFront();
+        damage = mBounds;
+    }
+
+    /* Commit the damage that was held back. */
+    if (level < ADAPT_PRIORITY && mHeld.valid()) {
+        damage = damage.valid() ? Rect::boundingRect(damage, mHeld) : mHeld;
+        mHeld = Rect();
+    }
+
+    if (!damage.valid())
+        return;
+
+    if (mDeferred.valid()) {
+        mDeferred = Rect::boundingRect(mDeferred, damage);
+    } else {
+        mDeferred = damage;
+        mDeferredTime = now_us();
+    }
+}
+
+void Screen::adapt()
+{
+    int64_t now, drained;
+    size_t queued, backlog;
+    bool busy;
+
+    if (!mAdaptTarget)
+        return;
+
+    now = now_us();
+    if (now - mAdaptSample < ADAPT_SAMPLE_US)
+        return;
+
+    queued = queued_bytes(mFd);
+    backlog = queued + mOut.size() - mOutPos + (mWriteInFlight ? mWriting.size() : 0);
+
+    if (!mAdaptSample) {
+        mAdaptSample = mAdaptChange = now;
+        mAdaptQueued = queued;
+        mAdaptWritten = mWritten;
+        mAdaptive.backlog = backlog;
+        return;
+    }
+
+    /* The terminal took what was queued before and what was written since, less what is queued now. */
+    drained = max((int64_t)(mAdaptQueued + (mWritten - mAdaptWritten)) - (int64_t)queued, (int64_t)0);
+
+    /* Only a terminal that had a backlog all along shows how fast it can take output. */
+    busy = mAdaptive.backlog > 0;
+    if (busy)
+        mAdaptive.drain_rate = drained * 1e6 / (now - mAdaptSample);
+    else
+        mAdaptive.drain_rate = max(mAdaptive.drain_rate, drained * 1e6 / (now - mAdaptSample));
+
+    if (!backlog)
+        mAdaptive.backlog_ms = 0;
+    else if (mAdaptive.drain_rate > 0)
+        mAdaptive.backlog_ms = backlog * 1e3 / mAdaptive.drain_rate;
+    else
+        mAdaptive.backlog_ms = -1;
+
+    mAdaptive.backlog = backlog;
+    mAdaptSample = now;
+    mAdaptQueued = queued;
+    mAdaptWritten = mWritten;
+
+    unsigned top = mPriority.empty() ? ADAPT_MONO : ADAPT_PRIORITY;
+    double target_ms = mAdaptTarget / 1e3;
+
+    if (busy && (mAdaptive.backlog_ms < 0 || mAdaptive.backlog_ms > target_ms)) {
+        mAdaptCalm = 0;
+        if (mAdaptive.level < top && now - mAdaptChange >= ADAPT_DEGRADE_US) {
+            setAdaptiveLevel(mAdaptive.level + 1);
+            mAdaptive.degrades++;
+            mAdaptChange = now;
+        }
+    } else if (mAdaptive.backlog_ms >= 0 && mAdaptive.backlog_ms * 4 <= target_ms) {
+        if (!mAdaptCalm)
+            mAdaptCalm = now;
+        if (mAdaptive.level > ADAPT_FULL && now - mAdaptCalm >= ADAPT_RESTORE_US) {
+            setAdaptiveLevel(mAdaptive.level - 1);
+            mAdaptive.restores++;
+            mAdaptCalm = mAdaptChange = now;
+        }
+    } else {
+        mAdaptCalm = 0;
+    }
+}
+
+Rect Screen::priorityDamage(const Rect& dirty) const
+{
+    Rect damage;
+
+    for (Surface *sf : mPriority) {
+        Rect r = sf->bounds();
+        const Surface *p = sf->parent();
+
+        /* Layer bounds are relative to their parent. */
+        for (; p && p != this; p = p->parent())
+            r.move(Point(r.top.x + p->pos().x, r.top.y + p->pos().y));
+
+        /* Not in the tree of this screen. */
+        if (!p)
+            continue;
+
+        r = Rect::intersect(r, dirty);
+        if (r.valid())
+            damage = damage.valid() ? Rect::boundingRect(damage, r) : r;
+    }
+
+    return damage;
+}
+
+int Screen::frameTimeout() const
+{
+    if (renderThreadRunning())
+        return -1;
+
+    /* Merged damage waits for the terminal to take the previous frame first. */
+    if (mOutPos < mOut.size() || mWriteInFlight)
+        return -1;
+
+    return commitTimeout();
+}
+
+int Screen::commitTimeout() const
+{
+    int64_t left;
+
+    if (!mDeferred.valid())
+        return -1;
+
+    left = mLastFrame + frameInterval() - now_us();
+    return left > 0 ? (left + 999) / 1000 : 0;
+}
+
+Screen::FrameStats Screen::frameStats() const
+{
+    if (!renderThreadRunning())
+        return mFrameStats;
+
+    lock_guard<mutex> lock(mStatsLock);
+    return mPublishedFrameStats;
+}
+
+int64_t Screen::frameTimePercentile(double p) const
+{
+    vector<int64_t> times;
+    size_t rank;
+
+    {
+        lock_guard<mutex> lock(mStatsLock);
+        times = mFrameTimes;
+    }
+
+    if (times.empty())
+        return 0;
+
+    /* Nearest rank. */
+    rank = (size_t)ceil(max(0.0, min(p, 100.0)) / 100 * times.size());
+    rank = rank ? rank - 1 : 0;
+    nth_element(times.begin(), times.begin() + rank, times.end());
+    return times[rank];
+}
+
+vector<size_t> Screen::frameTimeHistogram() const
+{
+    vector<size_t> hist(64);
+    lock_guard<mutex> lock(mStatsLock);
+
+    for (int64_t t : mFrameTimes)
+        hist[t > 0 ? 63 - __builtin_clzll(t) : 0]++;
+
+    return hist;
+}
+
+Screen::BackpressureStats Screen::backpressureStats() const
+{
+    if (!renderThreadRunning())
+        return mBackpressure;
+
+    lock_guard<mutex> lock(mStatsLock);
+    return mPublishedBackpressure;
+}
+
+void Screen::publishStats()
+{
+    lock_guard<mutex> lock(mStatsLock);
+    mPublishedFrameStats = mFrameStats;
+    mPublishedBackpressure = mBackpressure;
+}
+
+int Screen::commit(bool force)
+{
+    int64_t now, interval;
+    int ret;
+
+    adapt();
+
+    /* Finish writing the previous frame first. */
+    ret = flush(&mFrameStats);
+    if (ret || !mDeferred.valid())
+        return ret;
+
+    now = now_us();
+    interval = frameInterval();
+    if (!force && interval && now < mLastFrame + interval)
+        return -EAGAIN;
+
+    Rect dirty = mDeferred;
+
+    /* Only the priority layers are updated every frame. The rest is held back for a while. */
+    if (mAdaptive.level == ADAPT_PRIORITY) {
+        mHeld = mHeld.valid() ? Rect::boundingRect(mHeld, dirty) : dirty;
+
+        if (now - mHeldTime >= ADAPT_HELD_US) {
+            dirty = mHeld;
+            mHeld = Rect();
+            mHeldTime = now;
+        } else {
+            dirty = priorityDamage(mHeld);
+            mAdaptive.held++;
+        }
+
+        if (!dirty.valid()) {
+            mLastFrame = now;
+            mDeferred = Rect();
+            mDeferredFrames = 0;
+            mDeferredCollect = mDeferredCompose = 0;
+            return 0;
+        }
+    }
+
+    mFrameStats = FrameStats();
+    mFrameStats.renders = mDeferredFrames;
+    mFrameStats.interval_us = mLastFrame ? now - mLastFrame : 0;
+    mFrameStats.collect_ns = mDeferredCollect;
+    mFrameStats.compose_ns = mDeferredCompose;
+    /* Damage adaptive quality added is not from a render. */
+    if (mDeferredFrames > 1)
+        mBackpressure.dropped += mDeferredFrames - 1;
+    mBackpressure.frames++;
+    mLastFrame = now;
+
+    mDeferred = Rect();
+    mDeferredFrames = 0;
+    mDeferredCollect = mDeferredCompose = 0;
+
+    /* Mirrors still busy with earlier output skip this frame. Remember what they show. */
+    for (Mirror& m : mMirrors) {
+        if (m.synced && !m.out.empty()) {
+            m.synced = false;
+            m.front = mFront;
+            m.frontBounds = mFrontBounds;
+        }
+    }
+
+    /* A memory backed screen with a stream server only serves remote viewers. */
+    int64_t start = now_ns();
+    if (mFd >= 0 || !mStream)
+        encodeFrame(dirty);
+    mFrameStats.encode_ns = now_ns() - start;
+
+    if (mStream)
+        mStream->frame(mFrame, mFrameBounds, dirty);
+
+    if (mRecorder) {
+        start = now_ns();
+        mRecorder->frame(mFrame, mFrameBounds, dirty);
+        mFrameStats.record_ns = now_ns() - start;
+    }
+
+    /* Hand the whole frame to the terminal at once. */
+    ret = flush(&mFrameStats);
+    mFrameStats.latency_us = now_us() - mDeferredTime;
+    flushMirrors();
+
+    int64_t time = mFrameStats.collect_ns + mFrameStats.compose_ns + mFrameStats.encode_ns +
+                   mFrameStats.record_ns + mFrameStats.write_ns;
+    lock_guard<mutex> lock(mStatsLock);
+
+    if (mFrameTimes.size() < FRAME_WINDOW) {
+        mFrameTimes.push_back(time);
+    } else {
+        mFrameTimes[mFrameTimesPos] = time;
+        mFrameTimesPos = (mFrameTimesPos + 1) % FRAME_WINDOW;
+    }
+
+    return ret;
+}
+
+int Screen::startRenderThread(RenderPool *pool)
+{
+    int ret;
+
+    if (renderThreadRunning() || mWriter || !mMirrors.empty() || mStream || mAdaptTarget)
+        return -EBUSY;
+
+    /* Pool threads can not wait for terminals to drain. */
+    if (pool && mNonBlocking)
+        return -EINVAL;
+
+    mRenderEventFd = eventfd(0, EFD_NONBLOCK);
+    if (mRenderEventFd < 0)
+        return -errno;
+
+    /* Continue from the state rendering on this thread left behind. */
+    mSlotReady = 2;
+    mSlotBack = 0;
+    mSlotFront = 1;
+    mSlotSeq = mTakenSeq = 0;
+    mRenderStop = false;
+
+    /* Uncommitted damage refers to the screen buffer. Let the thread encode it from its own copy. */
+    mSlots[mSlotFront].data.assign(data(), data() + mBounds.size());
+    mFrame = mSlots[mSlotFront].data.data();
+    mFrameBounds = mBounds;
+
+    if (!pool) {
+        mRenderThread = thread(&Screen::renderLoop, this);
+        return 0;
+    }
+
+    mPool = pool;
+    ret = pool->add(this, mRenderEventFd);
+    if (ret) {
+        mPool = nullptr;
+        close(mRenderEventFd);
+        mRenderEventFd = -1;
+    }
+
+    return ret;
+}
+
+void Screen::stopRenderThread()
+{
+    if (!renderThreadRunning())
+        return;
+
+    if (mPool) {
+        mPool->remove(this, mRenderEventFd);
+        mPool = nullptr;
+
+        /* Take over the last snapshot and commands like the render thread hands them over. */
+        runCommands(mCommands.exchange(0));
+        takeSlot();
+    } else {
+        mRenderStop = true;
+        signalRenderThread();
+        mRenderThread.join();
+    }
+
+    close(mRenderEventFd);
+    mRenderEventFd = -1;
+
+    /* The last snapshot matches the screen buffer. Commit whatever the thread did not. */
+    mFrame = data();
+    mFrameBounds = mBounds;
+    commit(true);
+}
+
+void Screen::signalRenderThread(uint32_t commands)
+{
+    uint64_t one = 1;
+
+    mCommands.fetch_or(commands);
+
+    /* Non-blocking. The counter can not realistically overflow. */
+    if (write(mRenderEventFd, &one, sizeof(one)) < 0)
+        return;
+}
+
+void Screen::runCommands(uint32_t commands)
+{
+    if (commands & CMD_CLEAR) {
+        put("\x1b[0m\x1b[2J\x1b[1;1H");
+        mFront.assign(mFrontBounds.size(), unknown_char);
+    }
+
+    if (commands & CMD_CURSOR)
+        put(mCommandCursorVisible ? "\x1b[?25h" : "\x1b[?25l");
+
+    if (commands & CMD_CURSOR_POS) {
+        uint64_t pos = mCommandCursorPos;
+
+        put("\x1b[");
+        putNum(pos >> 32);
+        put(';');
+        putNum(pos & 0xffffffff);
+        put('H');
+    }
+}
+
+bool Screen::takeSlot()
+{
+    if (!(mSlotReady.load(memory_order_acquire) & SLOT_FRESH))
+        return false;
+
+    mSlotFront = mSlotReady.exchange(mSlotFront, memory_order_acq_rel) & SLOT_INDEX;
+
+    const RenderSlot& slot = mSlots[mSlotFront];
+    Rect dirty = slot.dirty;
+
+    /* Damage of superseded snapshots is not known. Diff the whole frame. */
+    if (slot.seq != mTakenSeq + 1 || slot.bounds != mFrameBounds)
+        dirty = slot.bounds;
+
+    if (mDeferred.valid() && slot.bounds == mFrameBounds) {
+        mDeferred = Rect::boundingRect(mDeferred, dirty);
+    } else {
+        if (!mDeferred.valid())
+            mDeferredTime = slot.time;
+        mDeferred = dirty;
+    }
+
+    mDeferredFrames += slot.seq - mTakenSeq;
+    mDeferredCollect += slot.collect_ns;
+    mDeferredCompose += slot.compose_ns;
+    mTakenSeq = slot.seq;
+    mFrame = slot.data.data();
+    mFrameBounds = slot.bounds;
+    return true;
+}
+
+void Screen::renderStep()
+{
+    uint32_t commands = mCommands.exchange(0);
+
+    runCommands(commands & ~CMD_CURSOR_POS);
+    takeSlot();
+    /* Pool threads are not woken up when a frame is due. */
+    commit(mPool != nullptr);
+    runCommands(commands & CMD_CURSOR_POS);
+    flush(&mFrameStats);
+    publishStats();
+}
+
+void Screen::renderLoop()
+{
+    struct pollfd pfd[2] = { { mRenderEventFd, POLLIN, 0 }, { mFd, POLLOUT, 0 } };
+    uint64_t cnt;
+
+    while (!mRenderStop) {
+        bool busy = mOutPos < mOut.size();
+
+        /* Wait for a snapshot, the terminal to drain or the next frame to be due. */
+        if (poll(pfd, busy ? 2 : 1, busy ? -1 : commitTimeout()) < 0 && errno != EINTR)
+            break;
+
+        if (pfd[0].revents & POLLIN && read(mRenderEventFd, &cnt, sizeof(cnt)) < 0)
+            break;
+
+        renderStep();
+    }
+
+    /* Hand the last snapshot and commands over to stopRenderThread(). */
+    runCommands(mCommands.exchange(0));
+    takeSlot();
+}
+
+void Screen::invalidateFront()
+{
+    mFront.assign(mBounds.size(), unknown_char);
+    mFrontBounds = mBounds;
+}
+
+/* @return Position of the complete primary device attributes reply CSI ? Ps ; ... c. npos if none. */
+static size_t da1_reply(const string& reply)
+{
+    size_t pos = reply.rfind("\x1b[?");
+
+    for (size_t i = pos + 3; pos != string::npos && i < reply.size(); i++) {
+        if (reply[i] == 'c')
+            return pos;
+        if (!isdigit(reply[i]) && reply[i] != ';')
+            break;
+    }
+
+    return string::npos;
+}
+
+/* @return The state of mode from a DECRQM reply CSI ? mode ; Ps $ y. 0 (not recognized) if none. */
+static int decrqm_reply(const string& reply, const char *mode)
+{
+    string prefix = string("\x1b[?") + mode + ';';
+    size_t pos = reply.find(prefix);
+
+    return pos != string::npos ? atoi(reply.c_str() + pos + prefix.size()) : 0;
+}
+
+/*
+ * Looks for an XTGETTCAP reply DCS 1 + r name [= value] ST with hex encoded name and value.
+ *
+ * @return true if the terminal has the capability.
+ */
+static bool xtgettcap_reply(const string& reply, const char *hex_name, string *value)
+{
+    string prefix = string("\x1bP1+r") + hex_name;
+    size_t pos = reply.find(prefix);
+
+    if (pos == string::npos)
+        return false;
+
+    pos += prefix.size();
+    if (pos >= reply.size() || (reply[pos] != '=' && reply[pos] != '\x1b'))
+        return false;
+
+    if (value && reply[pos] == '=') {
+        value->clear();
+        for (pos++; pos + 1 < reply.size() && isxdigit(reply[pos]) && isxdigit(reply[pos + 1]); pos += 2)
+            value->push_back(strtol(reply.substr(pos, 2).c_str(), nullptr, 16));
+    }
+
+    return true;
+}
+
+/* @return true if there is a kitty keyboard protocol flags reply CSI ? flags u. */
+static bool kitty_reply(const string& reply)
+{
+    for (size_t pos = reply.find("\x1b[?"); pos != string::npos; pos = reply.find("\x1b[?", pos + 1)) {
+        size_t i = pos + 3;
+
+        while (i < reply.size() && isdigit(reply[i]))
+            i++;
+        if (i > pos + 3 && i < reply.size() && reply[i] == 'u')
+            return true;
+    }
+
+    return false;
+}
+
+/* @return Path of the profile cache of this terminal. Empty if it can not be named. */
+static string profile_path(const string& term, const char *program, bool create_dir)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    string dir, name;
+
+    if (term.empty())
+        return "";
+
+    /* Terminals sharing a TERM can still differ. */
+    name = term;
+    if (program && *program)
+        name += string("+") + program;
+    replace(name.begin(), name.end(), '/', '_');
+
+    if (cache && *cache)
+        dir = cache;
+    else if (home && *home)
+        dir = string(home) + "/.cache";
+    else
+        return "";
+
+    if (create_dir)
+        mkdir(dir.c_str(), 0700);
+    dir += "/libconutils";
+    if (create_dir)
+        mkdir(dir.c_str(), 0700);
+
+    return dir + "/" + name;
+}
+
+static bool load_profile(const string& path, Screen::Profile& profile)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    char name[256] = "";
+    size_t len;
+    int ret;
+
+    if (!fp)
+        return false;
+
+    ret = fscanf(fp, "libconutils profile 1 %x %d %d %d",
+                 &profile.caps, &profile.level, &profile.type, &profile.version);
+
+    /* The name is the rest of the line after a space and may contain spaces itself. */
+    if (ret == 4 && fgets(name, sizeof(name), fp)) {
+        len = strcspn(name, "\n");
+        profile.name.assign(name + (name[0] == ' '), name + len);
+    }
+    fclose(fp);
+
+    return ret == 4;
+}
+
+static void save_profile(const string& path, const Screen::Profile& profile)
+{
+    string tmp = path + "." + to_string(getpid());
+    string name = profile.name;
+    FILE *fp;
+    bool ok;
+
+    /* The terminal picks the name. Keep it on its line. */
+    for (char& c : name) {
+        if ((unsigned char)c < 0x20 || c == 0x7f)
+            c = ' ';
+    }
+
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+        return;
+
+    ok = fprintf(fp, "libconutils profile 1\n%x %d %d %d %s\n",
+                 profile.caps, profile.level, profile.type, profile.version, name.c_str()) > 0;
+
+    /* Concurrent probes of the same terminal replace the whole file. */
+    if (fclose(fp) || !ok || rename(tmp.c_str(), path.c_str()))
+        unlink(tmp.c_str());
+}
+
+int Screen::query(const char *req, size_t len, string& reply, int timeout_ms)
+{
+    struct termios old_tio, tio;
+    struct pollfd pfd = { mInFd, POLLIN, 0 };
+    int64_t deadline = now_us() + (int64_t)timeout_ms * 1000;
+    char buf[256];
+    ssize_t sz;
+    int ret = -ETIMEDOUT;
+
+    if (tcgetattr(mInFd, &old_tio))
+        return -ENOTTY;
+
+    /* Replies must not be echoed or wait for a new line. */
+    tio = old_tio;
+    tio.c_lflag &= ~(ICANON | ECHO);
+    if (tcsetattr(mInFd, TCSANOW, &tio))
+        return -errno;
+
+    /*
+     * Every terminal answers primary device attributes (DA1) and in order.
+     * Its reply ends the wait even if the terminal ignored the request.
+     */
+    put(req, len);
+    put("\x1b[c");
+    flush();
+
+    reply.clear();
+    while (ret == -ETIMEDOUT) {
+        int64_t left = (deadline - now_us()) / 1000;
+
+        if (left <= 0 || poll(&pfd, 1, left) <= 0)
+            break;
+
+        sz = read(mInFd, buf, sizeof(buf));
+        if (sz <= 0) {
+            ret = -EIO;
+            break;
+        }
+
+        reply.append(buf, sz);
+        if (da1_reply(reply) != string::npos)
+            ret = 0;
+    }
+
+    tcsetattr(mInFd, TCSANOW, &old_tio);
+    return ret;
+}
+
+int Screen::probeCapabilities(int timeout_ms, bool cache)
+{
+    /* The environment describes the terminal of the process only. */
+    bool own = mFd == STDOUT_FILENO;
+    const char *colorterm = own ? getenv("COLORTERM") : nullptr;
+    string path = cache ? profile_path(mTerm, own ? getenv("TERM_PROGRAM") : nullptr, true) : "";
+    string req, reply;
+    Profile profile;
+    size_t pos;
+    int ret;
+
+    if (renderThreadRunning() || mWriter)
+        return -EBUSY;
+
+    if (!path.empty() && load_profile(path, profile)) {
+        mProfile = profile;
+        mCaps |= profile.caps & ENCODER_CAPS;
+        return 0;
+    }
+
+    /* Secondary device attributes. Reply is CSI > Pp ; Pv ; Pc c */
+    req = "\x1b[>c";
+
+    /* XTGETTCAP for TN, rep, bce and RGB. The Linux console would print them. */
+    if (mTerm.compare(0, 5, "linux"))
+        req += "\x1bP+q544e\x1b\\\x1bP+q726570\x1b\\\x1bP+q626365\x1b\\\x1bP+q524742\x1b\\";
+
+    /* DECRQM for synchronized output and SGR mouse. Replies are CSI ? mode ; Ps $ y */
+    req += "\x1b[?2026$p\x1b[?1006$p";
+
+    /* Kitty keyboard protocol flags. Reply is CSI ? flags u */
+    req += "\x1b[?u";
+
+    ret = query(req.data(), req.size(), reply, timeout_ms);
+    if (ret)
+        return ret;
+
+    /* The device attributes reply query() waits for tells the conformance level. */
+    pos = da1_reply(reply);
+    profile.level = atoi(reply.c_str() + pos + 3);
+
+    pos = reply.find("\x1b[>");
+    if (pos != string::npos && sscanf(reply.c_str() + pos + 3, "%d;%d", &profile.type, &profile.version) != 2)
+        profile.version = -1;
+
+    xtgettcap_reply(reply, "544e", &profile.name);
+
+    /* VT220 and later can erase characters, set scrolling regions and scroll. */
+    if (profile.level >= 62)
+        profile.caps |= CAP_SCROLL;
+
+    if (xtgettcap_reply(reply, "726570", nullptr))
+        profile.caps |= CAP_REP;
+
+    /* Erasing is only worth it if it fills with the current background. */
+    if (xtgettcap_reply(reply, "626365", nullptr))
+        profile.caps |= CAP_ERASE;
+
+    if (xtgettcap_reply(reply, "524742", nullptr) ||
+        (colorterm && (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit"))))
+        profile.caps |= CAP_TRUECOLOR;
+
+    /* 1 - set, 2 - reset, 3 - permanently set. 0 and 4 mean not supported. */
+    ret = decrqm_reply(reply, "2026");
+    if (ret >= 1 && ret <= 3)
+        profile.caps |= CAP_SYNC;
+
+    ret = decrqm_reply(reply, "1006");
+    if (ret >= 1 && ret <= 3)
+        profile.caps |= CAP_SGR_MOUSE;
+
+    if (kitty_reply(reply))
+        profile.caps |= CAP_KITTY_KEYS;
+
+    if (!path.empty())
+        save_profile(path, profile);
+
+    mProfile = profile;
+    mCaps |= profile.caps & ENCODER_CAPS;
+    return 0;
+}
+
+int Screen::setEncoder(Encoder encoder)
+{
+    if (encoder != ENCODER_XTERM && encoder != ENCODER_LINUX && encoder != ENCODER_VT100)
+        return -EINVAL;
+
+    mEncoder = encoder;
+    selectEncoders();
+    return 0;
+}
+
+void Screen::selectEncoders()
+{
+    /* Adaptive quality may show fewer colors than the family can. */
+    unsigned colors = adapt_levels[mAdaptive.level].colors;
+
+    switch (mEncoder) {
+    case ENCODER_XTERM:
+        if (colors >= 256)
+            mEncoders = encoders<xterm_family, palette256>();
+        else if (colors)
+            mEncoders = encoders<xterm_family, palette16>();
+        else
+            mEncoders = encoders<xterm_family, palette_mono>();
+        break;
+    case ENCODER_LINUX:
+        colors = min(colors, 16u);
+        if (colors)
+            mEncoders = encoders<linux_family, palette16>();
+        else
+            mEncoders = encoders<linux_family, palette_mono>();
+        break;
+    case ENCODER_VT100:
+        colors = 0;
+        mEncoders = encoders<vt100_family, palette_mono>();
+        break;
+    }
+
+    mAdaptive.colors = colors;
+}
+
+void Screen::clear()
+{
+    if (renderThreadRunning()) {
+        signalRenderThread(CMD_CLEAR);
+        invalidate();
+        return;
+    }
+
+    put("\x1b[0m\x1b[2J\x1b[1;1H");
+    flush();
+    invalidateFront();
+    invalidate();
+}
+
+void Screen::showCursor()
+{
+    if (renderThreadRunning()) {
+        mCommandCursorVisible = true;
+        signalRenderThread(CMD_CURSOR);
+        mCursorVisible = true;
+        return;
+    }
+
+    put("\x1b[?25h");
+    flush();
+    mCursorVisible = true;
+}
+
+void Screen::hideCursor()
+{
+    if (renderThreadRunning()) {
+        mCommandCursorVisible = false;
+        signalRenderThread(CMD_CURSOR);
+        mCursorVisible = false;
+        return;
+    }
+
+    put("\x1b[?25l");
+    flush();
+    mCursorVisible = false;
+}
+
+void Screen::setCursorPos(const Point& pos)
+{
+    if (renderThreadRunning()) {
+        mCommandCursorPos = (uint64_t)pos.y << 32 | (uint32_t)pos.x;
+        signalRenderThread(CMD_CURSOR_POS);
+        return;
+    }
+
+    put("\x1b[");
+    putNum(pos.y);
+    put(';');
+    putNum(pos.x);
+    put('H');
+    flush();
+}
+
+template <class Enc>
+void Screen::setAttr(const Attribute& requested)
+{
+    const Attribute& cur = mCurrentAttr;
+    /* What the terminal can show of it. */
+    const Attribute attr = Enc::attr(requested);
+    uint8_t flags = attr.flags & SGR_FLAGS;
+    uint8_t cur_flags = cur.flags & SGR_FLAGS;
+    sgr_params inc, reset;
+
+    if (mCurrentAttrValid && sgr_equal(attr, cur))
+        return;
+
+    mFrameStats.attr_changes++;
+
+    /* Reuse the sequence if this transition was already encoded. */
+    uint64_t key = sgr_key(Enc::dialect, mCurrentAttrValid, cur, attr);
+    SgrCacheEntry& entry = mSgrCache[sgr_slot(key)];
+
+    if (entry.key == key) {
+        put(entry.seq, entry.len);
+        mCurrentAttr = attr;
+        mCurrentAttrValid = true;
+        return;
+    }
+
+    size_t start = mOut.size();
+
+    /* Full sequence starting from a reset. Always valid. */
+    reset.push(0);
+    for (const sgr_flag& f : sgr_flags) {
+        if (flags & f.flag)
+            reset.push(f.on);
+    }
+    Enc::fg(reset, attr.fg);
+    Enc::bg(reset, attr.bg);
+
+    /* Transition only the differences from the current state. Dialects without SGR 22-27 can only add flags. */
+    bool incremental = mCurrentAttrValid && (Enc::sgr_off || !(cur_flags & ~flags));
+
+    if (incremental) {
+        for (const sgr_flag& f : sgr_flags) {
+            if ((flags ^ cur_flags) & f.flag)
+                inc.push(flags & f.flag ? f.on : f.off);
+        }
+        if (attr.fg != cur.fg)
+            Enc::fg(inc, attr.fg);
+        if (attr.bg != cur.bg)
+            Enc::bg(inc, attr.bg);
+    }
+
+    const sgr_params& params = (incremental && inc.len() <= reset.len()) ? inc : reset;
+
+    put("\x1b[");
+    for (size_t i = 0; i < params.count; i++) {
+        if (i)
+            put(';');
+        putParam(params.p[i]);
+    }
+    put('m');
+
+    entry.key = key;
+    entry.len = mOut.size() - start;
+    mOut.copy(entry.seq, entry.len, start);
+
+    mCurrentAttr = attr;
+    mCurrentAttrValid = true;
+}
+
+/* TODO: add support for extended characters. */
+template <class Enc>
+void Screen::drawChar(const Char& ch)
+{
+    setAttr<Enc>(ch.attr);
+    mFrameStats.glyph_bytes++;
+
+    /* Display only printable characters to not mess up the layout. */
+    if (isprint(ch.val))
+        put(ch.val);
+    else
+        put(' ');
+}
+
+template <class Enc>
+bool Screen::canReprint(ssize_t from, ssize_t to, ssize_t y) const
+{
+    const Char *buf = mFrame;
+    size_t offset = mFrameBounds.index_for(Point(from, y));
+
+    /* Attributes are not known yet. */
+    if (!mCurrentAttrValid)
+        return false;
+
+    /*
+     * Characters can be printed again only if the terminal already shows them
+     * and printing them will not require an attribute change.
+     */
+    for (ssize_t x = from; x < to; x++, offset++) {
+        const Char& ch = buf[offset];
+
+        if (ch != mFront[offset] || !sgr_equal(Enc::attr(ch.attr), mCurrentAttr) || !isprint(ch.val))
+            return false;
+    }
+
+    return true;
+}
+
+template <class Enc>
+size_t Screen::moveHorizontal(ssize_t from, ssize_t to, ssize_t y, bool emit)
+{
+    size_t n = (to > from) ? to - from : from - to;
+    size_t cost = rel_cost(n);
+    bool reprint = to > from && n < cost && canReprint<Enc>(from, to, y);
+
+    if (!emit)
+        return reprint ? n : cost;
+
+    if (reprint) {
+        const Char *buf = mFrame + mFrameBounds.index_for(Point(from, y));
+        while (n--)
+            put((buf++)->val);
+    } else if (n) {
+        put("\x1b[");
+        if (n > 1)
+            putNum(n);
+        put(to > from ? 'C' : 'D');
+    }
+
+    return reprint ? to - from : cost;
+}
+
+template <class Enc>
+void Screen::moveCursor(const Point& to)
+{
+    enum { CUP, REL, CR_REL, CRLF } method = CUP;
+    size_t best = cup_cost(to);
+    size_t cost;
+    ssize_t dy = to.y - mCursor.y;
+    size_t vert = rel_cost(dy < 0 ? -dy : dy);
+
+    if (mCursor == to)
+        return;
+
+    mFrameStats.cursor_moves++;
+
+    /* Pick the candidate that needs the least bytes. */
+    if (mCursor.x >= 0) {
+        cost = vert + moveHorizontal<Enc>(mCursor.x, to.x, to.y, false);
+        if (cost < best) {
+            best = cost;
+            method = REL;
+        }
+
+        cost = 1 + vert + moveHorizontal<Enc>(0, to.x, to.y, false);
+        if (cost < best) {
+            best = cost;
+            method = CR_REL;
+        }
+
+        if (dy > 0) {
+            cost = 2 * dy + moveHorizontal<Enc>(0, to.x, to.y, false);
+            if (cost < best) {
+                best = cost;
+                method = CRLF;
+            }
+        }
+    }
+
+    switch (method) {
+    case CUP:
+        /* ANSI terminal coordinates starts from 1. */
+        put("\x1b[");
+        if (to.x || to.y)
+            putNum(to.y + 1);
+        if (to.x) {
+            put(';');
+            putNum(to.x + 1);
+        }
+        put('H');
+        break;
+
+    case REL:
+    case CR_REL:
+        if (method == CR_REL)
+            put('\r');
+        if (dy) {
+            put("\x1b[");
+            if (vert > 3)
+                putNum(dy < 0 ? -dy : dy);
+            put(dy < 0 ? 'A' : 'B');
+        }
+        moveHorizontal<Enc>(method == CR_REL ? 0 : mCursor.x, to.x, to.y, true);
+        break;
+
+    case CRLF:
+        while (dy--)
+            put("\r\n");
+        moveHorizontal<Enc>(0, to.x, to.y, true);
+        break;
+    }
+
+    mCursor = to;
+}
+
+size_t Screen::repeatRun(size_t offset, size_t max) const
+{
+    const Char *buf = mFrame + offset;
+    size_t run = 0;
+
+    /* Stop at the last changed character. The ones after it are already on the terminal. */
+    for (size_t i = 1; i <= max && buf[i] == buf[0]; i++) {
+        if (buf[i] != mFront[offset + i])
+            run = i;
+    }
+
+    return run;
+}
+
+size_t Screen::blankRun(size_t offset, size_t max, size_t& changed) const
+{
+    const Char *buf = mFrame + offset;
+    size_t run = 0;
+
+    changed = 0;
+    for (; run < max && is_blank(buf[run]) && buf[run].attr.bg == buf[0].attr.bg; run++) {
+        if (buf[run] != mFront[offset + run])
+            changed = run + 1;
+    }
+
+    return run;
+}
+
+template <class Enc>
+size_t Screen::encodeRun(size_t offset, const Point& pos)
+{
+    const Char *buf = mFrame;
+    const Char& ch = buf[offset];
+    size_t width = mFrameBounds.width();
+    size_t max = width - pos.x;
+    size_t n = 1;
+    size_t run, changed;
+
+    moveCursor<Enc>(pos);
+
+    /* Erase runs of blank characters if it is cheaper than printing them. */
+    if ((Enc::caps & CAP_ERASE) && is_blank(ch)) {
+        run = blankRun(offset, max, changed);
+
+        if (run == max && changed > 3) {
+            /* Erase to the end of the line. */
+            setAttr<Enc>(ch.attr);
+            put("\x1b[K");
+            n = run;
+        } else if (!(Enc::caps & CAP_REP) && ech_cost(changed) + rel_cost(changed) < changed) {
+            /* Erasing does not move the cursor. Count in moving it afterwards. */
+            setAttr<Enc>(ch.attr);
+            put("\x1b[");
+            putNum(changed);
+            put('X');
+            n = changed;
+        }
+
+        if (n > 1) {
+            std::copy(buf + offset, buf + offset + n, mFront.begin() + offset);
+            return n;
+        }
+    }
+
+    drawChar<Enc>(ch);
+    mFront[offset] = ch;
+
+    /* Repeat runs of the same character if it is cheaper than printing them. */
+    if (Enc::caps & CAP_REP) {
+        run = repeatRun(offset, max - 1);
+        if (run && rep_cost(run) < run) {
+            put("\x1b[");
+            if (run > 1)
+                putNum(run);
+            put('b');
+
+            std::fill(mFront.begin() + offset + 1, mFront.begin() + offset + 1 + run, ch);
+            n += run;
+        }
+    }
+
+    /* The cursor does not advance past the last column. */
+    mCursor = (pos.x + n < width) ? Point(pos.x + n, pos.y) : Point(-1, -1);
+    return n;
+}
+
+size_t Screen::rowDiff(ssize_t y, ssize_t front_y) const
+{
+    size_t width = mFrameBounds.width();
+    const Char *row = mFrame + y * width;
+    const Char *front = mFront.data() + front_y * width;
+    size_t diff = 0;
+
+    for (size_t x = 0; x < width; x++)
+        diff += row[x] != front[x];
+
+    return diff;
+}
+
+void Screen::scroll(const Rect& dirty)
+{
+    const Char *buf = mFrame;
+    size_t width = mFrameBounds.width();
+    ssize_t top = dirty.top.y;
+    ssize_t bottom = dirty.bottom.y;
+    ssize_t shift = 0;
+    size_t best = 0;
+
+    mRowHash.resize(mFrameBounds.height());
+    mFrontRowHash.resize(mFrameBounds.height());
+
+    for (ssize_t y = top; y < bottom; y++) {
+        mRowHash[y] = row_hash(buf + y * width, width);
+        mFrontRowHash[y] = row_hash(mFront.data() + y * width, width);
+    }
+
+    /*
+     * Find the vertical shift that makes most rows match the last frame.
+     * Rows are matched as row y of the screen showing row y + shift of the last frame.
+     */
+    for (ssize_t d = top - bottom + 1; d < bottom - top; d++) {
+        size_t matches = 0;
+
+        if (!d)
+            continue;
+
+        for (ssize_t y = max(top, top - d); y < min(bottom, bottom - d); y++)
+            matches += mRowHash[y] == mFrontRowHash[y + d];
+
+        if (matches > best) {
+            best = matches;
+            shift = d;
+        }
+    }
+
+    if (best < 2)
+        return;
+
+    /* The scrolled region spans the first and the last matched row and their sources. */
+    ssize_t first = -1, last = -1;
+
+    for (ssize_t y = max(top, top - shift); y < min(bottom, bottom - shift); y++) {
+        if (mRowHash[y] == mFrontRowHash[y + shift]) {
+            if (first < 0)
+                first = y;
+            last = y;
+        }
+    }
+
+    ssize_t r_top = min(first, first + shift);
+    ssize_t r_bottom = max(last, last + shift) + 1;
+    ssize_t n = shift > 0 ? shift : -shift;
+    size_t before = 0, after = 0;
+
+    /* Compare what it takes to repaint the region with and without scrolling it. */
+    for (ssize_t y = r_top; y < r_bottom; y++) {
+        before += rowDiff(y, y);
+
+        if (y + shift >= r_top && y + shift < r_bottom)
+            after += rowDiff(y, y + shift);
+        else
+            after += width;
+    }
+
+    size_t cost = 7 + num_len(r_top + 1) + num_len(r_bottom) + rel_cost(n);
+    if (before <= after + cost)
+        return;
+
+    /* Set scrolling region, scroll it and restore the full screen region. */
+    put("\x1b[");
+    putNum(r_top + 1);
+    put(';');
+    putNum(r_bottom);
+    put("r\x1b[");
+    if (n > 1)
+        putNum(n);
+    put(shift > 0 ? 'S' : 'T');
+    put("\x1b[r");
+
+    /* Setting the region homes the cursor. */
+    mCursor = Point(0, 0);
+
+    /* Scroll the last frame the same way. Exposed rows are not known. */
+    Char *front = mFront.data();
+
+    if (shift > 0) {
+        std::copy(front + (r_top + n) * width, front + r_bottom * width, front + r_top * width);
+        std::fill(front + (r_bottom - n) * width, front + r_bottom * width, unknown_char);
+    } else {
+        std::copy_backward(front + r_top * width, front + (r_bottom - n) * width, front + r_bottom * width);
+        std::fill(front + r_top * width, front + (r_top + n) * width, unknown_char);
+    }
+}
+
+void Screen::encodeFrame(const Rect& dirty)
+{
+    /* The variant for the enabled capabilities. No capability is tested per cell. */
+    (this->*mEncoders.load()[mCaps.load() & ENCODER_CAPS])(dirty);
+}
+
+template <class Enc>
+void Screen::encode(const Rect& dirty)
+{
+    const Char *buf = mFrame;
+    size_t offset = 0;
+    size_t start = mOut.size();
+
+    /* Nothing is known about the terminal contents after a resize. */
+    if (mFrontBounds != mFrameBounds) {
+        mFront.assign(mFrameBounds.size(), unknown_char);
+        mFrontBounds = mFrameBounds;
+    }
+
+    /* Begin synchronized update. Dropped below if nothing else was encoded. */
+    if (Enc::caps & CAP_SYNC)
+        put("\x1b[?2026h");
+
+    /* Invalidate current attributes and cursor position. */
+    mCurrentAttrValid = false;
+    mCursor = Point(-1, -1);
+
+    /* Shifted content of full width regions can be scrolled instead of repainted. */
+    if ((Enc::caps & CAP_SCROLL) && dirty.width() == mFrameBounds.width() && dirty.height() > 2)
+        scroll(dirty);
+
+    /* Encode only the characters in the dirty region that differ from the last frame. */
+    for (ssize_t y = dirty.top.y; y < dirty.bottom.y; y++) {
+        offset = mFrameBounds.index_for(Point(dirty.top.x, y));
+        for (ssize_t x = dirty.top.x; x < dirty.bottom.x;) {
+            if (buf[offset] == mFront[offset]) {
+                x++;
+                offset++;
+                continue;
+            }
+
+            /* Runs may extend past the dirty region. The screen buffer is valid there too. */
+            size_t n = encodeRun<Enc>(offset, Point(x, y));
+            x += n;
+            offset += n;
+            mFrameStats.cells_emitted += n;
+        }
+    }
+
+    mFrameStats.cells_scanned += dirty.size();
+
+    /* End synchronized update. */
+    if (Enc::caps & CAP_SYNC) {
+        if (mOut.size() == start + sizeof("\x1b[?2026h") - 1)
+            mOut.resize(start);
+        else
+            put("\x1b[?2026l");
+    }
+
+    mFrameStats.escape_bytes = mOut.size() - start - mFrameStats.glyph_bytes;
+}
+
+void Screen::renderBegin(const Rect& dirty)
+{
+    /* Readers of the exported screen retry while the sequence is odd. */
+    if (mExport) {
+        mExport->seq.store(mExport->seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+void Screen::renderDone(const Rect& dirty)
+{
+    int64_t collect, compose;
+
+    if (mExport) {
+        mExport->generation++;
+        mExport->dirty_left = dirty.top.x;
+        mExport->dirty_top = dirty.top.y;
+        mExport->dirty_right = dirty.bottom.x;
+        mExport->dirty_bottom = dirty.bottom.y;
+        mExport->seq.store(mExport->seq.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    /* Hand a snapshot over to the render thread. */
+    if (renderThreadRunning()) {
+        RenderSlot& slot = mSlots[mSlotBack];
+
+        slot.data.assign(data(), data() + mBounds.size());
+        slot.bounds = mBounds;
+        slot.dirty = dirty;
+        slot.seq = ++mSlotSeq;
+        slot.time = now_us();
+        renderTimes(slot.collect_ns, slot.compose_ns);
+
+        mSlotBack = mSlotReady.exchange(mSlotBack | SLOT_FRESH, memory_order_acq_rel) & SLOT_INDEX;
+        signalRenderThread();
+        return;
+    }
+
+    renderTimes(collect, compose);
+    mDeferredCollect += collect;
+    mDeferredCompose += compose;
+
+    /* Accumulate damage until the next frame is committed. */
+    if (mDeferred.valid()) {
+        mDeferred = Rect::boundingRect(mDeferred, dirty);
+    } else {
+        mDeferred = dirty;
+        mDeferredTime = now_us();
+    }
+    mDeferredFrames++;
+
+    adapt();
+
+    /* The terminal is still busy with the previous frame. Keep merging. */
+    if (mNonBlocking && (mOutPos < mOut.size() || mWriteInFlight) && flush(&mFrameStats) == -EAGAIN) {
+        mBackpressure.merged++;
+        return;
+    }
+
+    mFrame = data();
+    mFrameBounds = mBounds;
+    commit();
 }
@@ -0,0 +1,427 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "delta.h"
+
+using namespace std;
+using namespace conutils;
+
+/* Bytes read at once by clients. */
+#define READ_SIZE     (64 * 1024)
+
+static int64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+        return -errno;
+    return 0;
+}
+
+static int unix_address(const char *path, struct sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+
+    strcpy(addr.sun_path, path);
+    return 0;
+}
+
+StreamServer::StreamServer() : mStart(now_us())
+{
+}
+
+StreamServer::~StreamServer()
+{
+    for (auto& c : mClients)
+        close(c->fd);
+
+    if (mListenFd >= 0) {
+        close(mListenFd);
+        unlink(mPath.c_str());
+    }
+}
+
+int StreamServer::listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd, ret;
+
+    if (mListenFd >= 0)
+        return -EBUSY;
+
+    ret = unix_address(path, addr);
+    if (ret)
+        return ret;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || ::listen(fd, 16)) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    mListenFd = fd;
+    mPath = path;
+    return fd;
+}
+
+int StreamServer::accept()
+{
+    int fd, ret;
+
+    if (mListenFd < 0)
+        return -EINVAL;
+
+    fd = accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+        return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+
+    ret = addClient(fd);
+    if (ret) {
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+int StreamServer::addClient(int fd)
+{
+    int ret;
+
+    for (auto& c : mClients) {
+        if (c->fd == fd)
+            return -EEXIST;
+    }
+
+    ret = set_nonblocking(fd);
+    if (ret)
+        return ret;
+
+    mClients.emplace_back(new Client());
+    mClients.back()->fd = fd;
+    mClients.back()->connected = now_us();
+
+    /* Late joiners start with a keyframe of the current frame. */
+    send(*mClients.back());
+    return 0;
+}
+
+int StreamServer::removeClient(int fd)
+{
+    for (auto it = mClients.begin(); it != mClients.end(); it++) {
+        if ((*it)->fd == fd) {
+            close(fd);
+            mClients.erase(it);
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+vector<int> StreamServer::clientFds() const
+{
+    vector<int> fds;
+
+    for (auto& c : mClients) {
+        if (c->pos < c->out.size())
+            fds.push_back(c->fd);
+    }
+
+    return fds;
+}
+
+int StreamServer::clientStats(int fd, Stats& stats) const
+{
+    for (auto& c : mClients) {
+        if (c->fd == fd) {
+            stats = c->stats;
+            stats.connected_us = now_us() - c->connected;
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+void StreamServer::write(Client& c)
+{
+    ssize_t sz;
+
+    while (!c.error && c.pos < c.out.size()) {
+        sz = ::send(c.fd, c.out.data() + c.pos, c.out.size() - c.pos, MSG_NOSIGNAL);
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                c.error = -errno;
+            break;
+        }
+
+        c.pos += sz;
+        c.stats.bytes += sz;
+    }
+
+    if (c.pos == c.out.size()) {
+        c.out.clear();
+        c.pos = 0;
+    }
+}
+
+void StreamServer::send(Client& c)
+{
+    bool keyframe = c.keyframe || c.sentBounds != mBounds;
+
+    if (!mBounds.valid() || (!keyframe && !c.damage.valid()))
+        return;
+
+    c.stats.cells += delta_encode(c.out, mFrame.data(), mBounds, c.damage, c.sent, c.sentBounds,
+                                  keyframe, now_us() - mStart);
+    c.stats.frames++;
+    c.stats.keyframes += keyframe;
+    c.keyframe = false;
+    c.damage = Rect();
+
+    write(c);
+}
+
+void StreamServer::frame(const Char *data, const Rect& bounds, const Rect& dirty)
+{
+    Rect d = Rect::intersect(dirty, bounds);
+
+    /* Keep the frame for clients that catch up later. */
+    if (bounds != mBounds) {
+        mFrame.assign(data, data + bounds.size());
+        mBounds = bounds;
+        d = bounds;
+    } else {
+        for (ssize_t y = d.top.y; d.valid() && y < d.bottom.y; y++) {
+            size_t offset = bounds.index_for(Point(d.top.x, y));
+
+            std::copy(data + offset, data + offset + d.width(), mFrame.begin() + offset);
+        }
+    }
+
+    if (!d.valid())
+        return;
+
+    for (auto& c : mClients) {
+        c->damage = c->damage.valid() ? Rect::boundingRect(c->damage, d) : d;
+
+        if (c->out.empty())
+            send(*c);
+        else
+            c->stats.merged++;
+    }
+}
+
+int StreamServer::flush()
+{
+    int removed = 0;
+
+    for (auto it = mClients.begin(); it != mClients.end();) {
+        Client& c = **it;
+
+        write(c);
+        if (c.out.empty())
+            send(c);
+
+        if (c.error) {
+            close(c.fd);
+            it = mClients.erase(it);
+            removed++;
+        } else {
+            it++;
+        }
+    }
+
+    return removed;
+}
+
+StreamClient::StreamClient(Screen *screen) : mScreen(screen), mSurface(screen->width(), screen->height())
+{
+    mScreen->addLayer(&mSurface);
+}
+
+StreamClient::~StreamClient()
+{
+    mScreen->removeLayer(&mSurface);
+    if (mFd >= 0)
+        close(mFd);
+}
+
+int StreamClient::connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd, ret;
+
+    ret = unix_address(path, addr);
+    if (ret)
+        return ret;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    ret = attach(fd);
+    if (ret)
+        close(fd);
+    return ret;
+}
+
+int StreamClient::attach(int fd)
+{
+    int ret = set_nonblocking(fd);
+
+    if (ret)
+        return ret;
+
+    if (mFd >= 0)
+        close(mFd);
+
+    mFd = fd;
+    mEof = false;
+    mIn.clear();
+    mCells.clear();
+    mBounds = Rect();
+    return 0;
+}
+
+int StreamClient::process()
+{
+    const uint8_t *rec;
+    size_t pos = 0, size;
+    int64_t time;
+    Rect damage, dirty;
+    ssize_t sz;
+    int frames = 0, ret;
+    bool keyframe = false;
+
+    if (mEof)
+        return -EPIPE;
+
+    /* Take everything there is. Frames that arrived together are rendered once. */
+    while (true) {
+        size_t len = mIn.size();
+
+        mIn.resize(len + READ_SIZE);
+        sz = read(mFd, &mIn[len], READ_SIZE);
+        mIn.resize(len + max(sz, (ssize_t)0));
+
+        if (sz > 0) {
+            mStats.bytes += sz;
+            continue;
+        }
+
+        if (sz == 0) {
+            mEof = true;
+            break;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        return -errno;
+    }
+
+    while ((size = delta_record_size((const uint8_t *)mIn.data() + pos, mIn.size() - pos))) {
+        rec = (const uint8_t *)mIn.data() + pos;
+
+        /* A new size repaints everything. */
+        if (rec[0] == DELTA_KEYFRAME) {
+            damage = Rect(0, 0, mSurface.width(), mSurface.height());
+            keyframe = true;
+        }
+
+        ret = delta_decode(rec, mCells, mBounds, dirty, time);
+        if (ret)
+            return ret;
+
+        if (rec[0] != DELTA_KEYFRAME && dirty.valid())
+            damage = damage.valid() ? Rect::boundingRect(damage, dirty) : dirty;
+
+        mStats.frames++;
+        mStats.keyframes += rec[0] == DELTA_KEYFRAME;
+        frames++;
+        pos += size;
+    }
+
+    mIn.erase(0, pos);
+
+    /*
+     * The remote screen may have shrunk, so cells outside the new bounds
+     * would keep showing the old picture. Blank them; fill() also
+     * invalidates the whole surface.
+     */
+    if (keyframe)
+        mSurface.fill(Char());
+
+    damage = Rect::intersect(damage, Rect::intersect(mBounds, Rect(0, 0, mSurface.width(), mSurface.height())));
+    if (damage.valid()) {
+        for (ssize_t y = damage.top.y; y < damage.bottom.y; y++) {
+            const Char *src = mCells.data() + mBounds.index_for(Point(damage.top.x, y));
+
+            std::copy(src, src + damage.width(), mSurface.data() + y * mSurface.width() + damage.top.x);
+        }
+
+        mSurface.invalidate(damage);
+    }
+
+    if (damage.valid() || keyframe) {
+        mSurface.render();
+        mStats.renders++;
+    }
+
+    if (!frames && mEof)
+        return -EPIPE;
+    return frames;
+}
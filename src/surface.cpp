@@ -17,13 +17,31 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <sstream>
 
+#include <time.h>
+
 #include "conutils.h"
 
 using namespace std;
 using namespace conutils;
 
+/* Timing of the render() chain in progress. Each surface tree is used from a single thread. */
+static thread_local struct {
+    int depth;
+    int64_t start;
+    int64_t collect;
+} render_timing;
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 Surface::Surface(size_t width, size_t height)
 {
     resize(width, height);
@@ -63,7 +81,7 @@ const Rect& Surface::invalidate(const size_t start, const size_t end)
 
 int Surface::resize(size_t width, size_t height)
 {
-    mData = unique_ptr<Char>(new Char[width * height]);
+    mData = unique_ptr<Char, function<void (Char *)>>(new Char[width * height], [](Char *data) { delete[] data; });
     if (!mData.get())
         return -ENOMEM;
 
@@ -76,6 +94,12 @@ int Surface::resize(size_t width, size_t height)
     return 0;
 }
 
+void Surface::setBuffer(Char *data, function<void (Char *)> release)
+{
+    std::copy(mData.get(), mData.get() + size(), data);
+    mData = unique_ptr<Char, function<void (Char *)>>(data, release);
+}
+
 int Surface::fill(const Char& pattern, const Rect& crop)
 {
     Rect dirty = mBounds;
@@ -324,6 +348,13 @@ int Surface::moveZ(int Z)
 
 void Surface::render()
 {
+    int64_t start = now_ns();
+
+    if (!render_timing.depth++) {
+        render_timing.start = start;
+        render_timing.collect = 0;
+    }
+
     /* First get the combined dirty region from all layers. */
     for (auto& lm_iter : mLayerMap) {
         set<Surface *>& layer = lm_iter.second;
@@ -341,9 +372,15 @@ void Surface::render()
         }
     }
 
+    render_timing.collect += now_ns() - start;
+
     /* Nothing to update here. */
-    if (!mDirty.valid())
+    if (!mDirty.valid()) {
+        render_timing.depth--;
         return;
+    }
+
+    renderBegin(mDirty);
 
     /* If we are rendering other layers onto this surface make sure to clear the dirty region first. */
     if (!mLayerMap.empty())
@@ -378,6 +415,13 @@ void Surface::render()
 
     /* We are done rendering, mark it clean. */
     mDirty = Rect();
+    render_timing.depth--;
+}
+
+void Surface::renderTimes(int64_t& collect_ns, int64_t& compose_ns) const
+{
+    collect_ns = render_timing.collect;
+    compose_ns = now_ns() - render_timing.start - render_timing.collect;
 }
 
 string Surface::str(string ident) const
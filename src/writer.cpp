@@ -0,0 +1,416 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+/* Largest single write. Longer ones are continued like partial writes. */
+#define MAX_WRITE (1U << 30)
+
+/* Memory mapped submission and completion queues of an io_uring instance. */
+struct AsyncWriter::Ring {
+    int fd = -1;
+    void *sq_ptr = MAP_FAILED;
+    void *cq_ptr = MAP_FAILED;
+    size_t sq_len = 0;
+    size_t cq_len = 0;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    /* Local tail of filled entries, published to sq_tail by flush(). */
+    unsigned sqe_tail;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+    /* Submission queue entries filled but not submitted yet. */
+    unsigned queued = 0;
+    /* Submitted entries whose completions were not reaped yet. */
+    unsigned pending = 0;
+
+    ~Ring();
+    int init(unsigned entries);
+    unsigned space() const;
+    struct io_uring_sqe *getSqe();
+    void flush();
+    int enter(unsigned to_submit, unsigned min_complete);
+};
+
+AsyncWriter::Ring::~Ring()
+{
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_len);
+    if (sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_len);
+    if (fd >= 0)
+        close(fd);
+}
+
+int AsyncWriter::Ring::init(unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return -errno;
+
+    /* Writes at the current file position need 5.6 and so does IORING_OP_WRITE. */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+        return -ENOSYS;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = max(sq_len, cq_len);
+
+    sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return -errno;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else
+        cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED)
+        return -errno;
+
+    sq_entries = p.sq_entries;
+    sqes = (struct io_uring_sqe *)mmap(nullptr, sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return -errno;
+
+    sq = (char *)sq_ptr;
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    sqe_tail = *sq_tail;
+
+    cq = (char *)cq_ptr;
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    cq_entries = p.cq_entries;
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+unsigned AsyncWriter::Ring::space() const
+{
+    unsigned sq_free = sq_entries - (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+
+    /* Do not submit more than the completion queue can take. */
+    return min(sq_free, cq_entries - queued - pending);
+}
+
+struct io_uring_sqe *AsyncWriter::Ring::getSqe()
+{
+    unsigned tail = sqe_tail++;
+    struct io_uring_sqe *sqe;
+
+    sqe = &sqes[tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[tail & sq_mask] = tail & sq_mask;
+    queued++;
+    return sqe;
+}
+
+void AsyncWriter::Ring::flush()
+{
+    /* The kernel may read entries as soon as it sees the tail, so publish it only once they are filled. */
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+}
+
+int AsyncWriter::Ring::enter(unsigned to_submit, unsigned min_complete)
+{
+    int ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+    if (ret < 0)
+        return -errno;
+
+    queued -= ret;
+    pending += ret;
+    return 0;
+}
+
+AsyncWriter::AsyncWriter(unsigned entries, bool io_uring)
+{
+    if (!io_uring)
+        return;
+
+    /* Kernels without io_uring or with it disabled get the fallback. */
+    mRing = unique_ptr<Ring>(new Ring());
+    if (mRing->init(entries))
+        mRing.reset();
+}
+
+AsyncWriter::~AsyncWriter()
+{
+}
+
+int AsyncWriter::write(int fd, const void *data, size_t len, Callback done)
+{
+    Request *req;
+
+    if (fd < 0 || !done)
+        return -EINVAL;
+
+    /* Writes to the same fd could be reordered. */
+    if (!mFds.insert(fd).second)
+        return -EBUSY;
+
+    if (mFree.empty()) {
+        mRequests.push_back(unique_ptr<Request>(new Request()));
+        mFree.push_back(mRequests.back().get());
+    }
+
+    req = mFree.back();
+    mFree.pop_back();
+
+    req->fd = fd;
+    req->data = (const char *)data;
+    req->len = len;
+    req->done = 0;
+    req->result = 0;
+    req->poll = false;
+    req->callback = move(done);
+
+    mQueue.push_back(req);
+    return 0;
+}
+
+void AsyncWriter::complete(Request *req, ssize_t result)
+{
+    req->result = result;
+    mDone.push_back(req);
+
+    if (result >= 0) {
+        mStats.writes++;
+        mStats.bytes += result;
+    }
+}
+
+void AsyncWriter::writeOnce(Request *req)
+{
+    ssize_t sz = ::write(req->fd, req->data + req->done, min(req->len - req->done, (size_t)MAX_WRITE));
+
+    mStats.syscalls++;
+
+    if (sz < 0) {
+        if (errno == EINTR)
+            return;
+
+        if (errno == EAGAIN) {
+            req->poll = true;
+            return;
+        }
+
+        complete(req, -errno);
+        return;
+    }
+
+    req->done += sz;
+    req->poll = req->done < req->len;
+    if (!req->poll)
+        complete(req, req->done);
+}
+
+int AsyncWriter::submit()
+{
+    struct io_uring_sqe *sqe;
+    size_t n = mQueue.size();
+
+    /* Fallback. Try everything that does not wait for poll(). */
+    if (!mRing) {
+        for (size_t i = 0; i < n; i++) {
+            Request *req = mQueue.front();
+
+            mQueue.pop_front();
+            if (!req->poll)
+                writeOnce(req);
+            if (!req->result && req->done < req->len)
+                mQueue.push_back(req);
+        }
+
+        return 0;
+    }
+
+    while (!mQueue.empty()) {
+        Request *req = mQueue.front();
+
+        if (mRing->space() < (req->poll ? 2U : 1U))
+            break;
+
+        /* A write that would block waits for POLLOUT in a linked request. */
+        if (req->poll) {
+            sqe = mRing->getSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = req->fd;
+            sqe->poll32_events = POLLOUT;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = 0;
+        }
+
+        sqe = mRing->getSqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = req->fd;
+        sqe->addr = (uintptr_t)(req->data + req->done);
+        sqe->len = min(req->len - req->done, (size_t)MAX_WRITE);
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = (uintptr_t)req;
+        mQueue.pop_front();
+    }
+
+    if (!mRing->queued)
+        return 0;
+
+    mRing->flush();
+    mStats.syscalls++;
+    return mRing->enter(mRing->queued, 0);
+}
+
+int AsyncWriter::wait(int timeout_ms)
+{
+    int ret;
+
+    /* Fallback. Wait for the writes that would block and continue them. */
+    if (!mRing) {
+        mPollFds.clear();
+        for (Request *req : mQueue) {
+            if (req->poll)
+                mPollFds.push_back({ req->fd, POLLOUT, 0 });
+        }
+
+        if (mPollFds.empty())
+            return 0;
+
+        mStats.syscalls++;
+        ret = poll(mPollFds.data(), mPollFds.size(), mDone.empty() ? timeout_ms : 0);
+        if (ret <= 0)
+            return ret < 0 && errno != EINTR ? -errno : 0;
+
+        size_t i = 0;
+        for (Request *req : mQueue) {
+            if (!req->poll)
+                continue;
+
+            if (mPollFds[i++].revents)
+                writeOnce(req);
+        }
+
+        /* Drop the completed ones from the queue. */
+        for (size_t n = mQueue.size(); n; n--) {
+            Request *req = mQueue.front();
+
+            mQueue.pop_front();
+            if (!req->result && req->done < req->len)
+                mQueue.push_back(req);
+        }
+
+        return 0;
+    }
+
+    unsigned head = *mRing->cq_head;
+
+    /* The ring fd becomes readable once there are completions. */
+    if (mDone.empty() && mRing->pending && head == __atomic_load_n(mRing->cq_tail, __ATOMIC_ACQUIRE) && timeout_ms) {
+        struct pollfd pfd = { mRing->fd, POLLIN, 0 };
+
+        mStats.syscalls++;
+        if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+            return -errno;
+    }
+
+    /* Reap completions. */
+    for (; head != __atomic_load_n(mRing->cq_tail, __ATOMIC_ACQUIRE); head++) {
+        const struct io_uring_cqe *cqe = &mRing->cqes[head & mRing->cq_mask];
+        Request *req = (Request *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+
+        mRing->pending--;
+
+        /* Linked poll. Its write reports errors. */
+        if (!req)
+            continue;
+
+        if (res == -EAGAIN || res == -EINTR) {
+            req->poll = res == -EAGAIN;
+            mQueue.push_back(req);
+        } else if (res < 0) {
+            complete(req, res);
+        } else {
+            req->done += res;
+            req->poll = false;
+            if (req->done < req->len)
+                mQueue.push_back(req);
+            else
+                complete(req, req->done);
+        }
+    }
+
+    __atomic_store_n(mRing->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int AsyncWriter::process(int timeout_ms)
+{
+    vector<Request *> done;
+    int ret;
+
+    ret = submit();
+    if (!ret)
+        ret = wait(timeout_ms);
+    if (ret)
+        return ret;
+
+    /* Callbacks may queue new writes. Take the completed ones out first. */
+    done.swap(mDone);
+    for (Request *req : done) {
+        Callback callback = move(req->callback);
+
+        mFds.erase(req->fd);
+        req->callback = nullptr;
+        mFree.push_back(req);
+        callback(req->result);
+    }
+
+    ret = submit();
+    return ret ? ret : done.size();
+}
@@ -0,0 +1,141 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * confmtbench - measures the decimal formatting of escape sequence parameters
+ * against an ostream and the plain divide loop it replaced, in ns per call.
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "format.h"
+
+using namespace std;
+using namespace conutils;
+
+/* Output is cleared once it grows past this, like a frame buffer after a flush. */
+#define FRAME_SIZE 65536
+
+#define PASSES 5
+
+static volatile size_t sink;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n rounds  Times every value range is formatted per pass. Default: 200.\n",
+            name);
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void format_ostream(string& out, size_t num)
+{
+    static ostringstream os;
+
+    os.str(string());
+    os << (ssize_t)num;
+    out += os.str();
+}
+
+/* The formatting before the digit tables, one division per digit. */
+static void format_divide(string& out, size_t num)
+{
+    char buf[20];
+    size_t i = sizeof(buf);
+
+    do {
+        buf[--i] = '0' + num % 10;
+        num /= 10;
+    } while (num);
+
+    out.append(buf + i, sizeof(buf) - i);
+}
+
+template <class Format>
+static void bench(const char *name, Format format, size_t max, unsigned rounds)
+{
+    int64_t start, best = INT64_MAX;
+    string out;
+
+    out.reserve(FRAME_SIZE + 32);
+
+    /* The best of a few passes, timings on a busy machine only ever get worse. */
+    for (int pass = 0; pass < PASSES; pass++) {
+        start = now_ns();
+
+        for (unsigned r = 0; r < rounds; r++) {
+            for (size_t num = 0; num <= max; num++) {
+                format(out, num);
+                if (out.size() >= FRAME_SIZE) {
+                    sink += out.size();
+                    out.clear();
+                }
+            }
+        }
+
+        best = min(best, now_ns() - start);
+    }
+
+    sink += out.size();
+    printf("%-32s %6.1f ns\n", name, (double)best / ((double)rounds * (max + 1)));
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned rounds = 200;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:h")) != -1) {
+        switch (c) {
+        case 'n':
+            rounds = strtoul(optarg, nullptr, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!rounds) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bench("ostream << ssize_t, 0..65535", format_ostream, 65535, rounds / 10 + 1);
+    bench("divide loop, 0..65535", format_divide, 65535, rounds);
+    bench("digit pairs, 0..65535", format_num, 65535, rounds);
+    bench("divide loop, 0..255", format_divide, 255, rounds * 256);
+    bench("8 bit table, 0..255", [](string& out, size_t num) { format_u8(out, num); }, 255, rounds * 256);
+    return 0;
+}
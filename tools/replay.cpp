@@ -0,0 +1,208 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * conreplay - plays recordings and captured terminal output through a screen
+ * and reports the throughput of the compositor and the encoder.
+ */
+
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+struct options {
+    bool ansi = false;
+    size_t frame_bytes = 0;
+    uint32_t caps = Screen::CAP_REP | Screen::CAP_ERASE | Screen::CAP_SCROLL | Screen::CAP_SYNC;
+    size_t width = 80;
+    size_t height = 24;
+    unsigned count = 1;
+    double speed = 0;
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] file...\n"
+            "  -a         Read files as captured terminal output even if they are recordings.\n"
+            "  -b bytes   End a frame of captured output every bytes. Default: at synchronized updates.\n"
+            "  -c caps    Screen capabilities in hex. Default: f.\n"
+            "  -s WxH     Screen size for captured output. Default: 80x24. Recordings use their own.\n"
+            "  -n count   Play every file count times. Default: 1.\n"
+            "  -t speed   Play on this terminal at a multiple of the recorded timing.\n",
+            name);
+}
+
+static int read_file(const char *path, string& data)
+{
+    char buf[65536];
+    ssize_t sz;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    while ((sz = read(fd, buf, sizeof(buf))) > 0 || (sz < 0 && errno == EINTR)) {
+        if (sz > 0)
+            data.append(buf, sz);
+    }
+
+    close(fd);
+    return sz < 0 ? -errno : 0;
+}
+
+static Screen *make_screen(const options& opt, size_t width, size_t height, unique_ptr<Screen>& headless)
+{
+    Screen *sc;
+
+    if (opt.speed > 0) {
+        sc = Screen::getInstance();
+    } else {
+        headless = Screen::createHeadless(width, height);
+        sc = headless.get();
+    }
+
+    if (sc)
+        sc->setCapabilities(opt.caps);
+    return sc;
+}
+
+static int play(const char *path, const options& opt)
+{
+    unique_ptr<Screen> headless;
+    Recording rec;
+    Screen *sc;
+    string data;
+    int ret = -EINVAL;
+
+    if (!opt.ansi)
+        ret = rec.open(path);
+
+    if (!ret) {
+        /* Size the screen after the first frame. */
+        ret = rec.next();
+        if (ret <= 0 || (ret = rec.seek(0)))
+            return ret ? ret : -EINVAL;
+
+        sc = make_screen(opt, rec.bounds().width(), rec.bounds().height(), headless);
+        if (!sc)
+            return -ENODEV;
+
+        Replay replay(sc);
+        replay.setSpeed(opt.speed);
+
+        for (unsigned i = 0; i < opt.count; i++) {
+            ret = rec.seek(0);
+            if (!ret)
+                ret = replay.play(rec);
+            if (ret < 0)
+                return ret;
+        }
+
+        const Replay::Stats& st = replay.stats();
+        fprintf(stderr, "%s: recording of %zu frames, %zu keyframes\n", path, rec.frames(), rec.keyframes());
+        fprintf(stderr, "%s: %zu frames in %.3f s, %.0f fps, in %.1f MB/s, out %.1f MB/s\n", path,
+                st.frames, st.elapsed_ns / 1e9, st.fps(), st.inputRate() / 1e6, st.outputRate() / 1e6);
+        return 0;
+    }
+
+    if (ret != -EINVAL)
+        return ret;
+
+    ret = read_file(path, data);
+    if (ret)
+        return ret;
+
+    sc = make_screen(opt, opt.width, opt.height, headless);
+    if (!sc)
+        return -ENODEV;
+
+    Replay replay(sc);
+
+    for (unsigned i = 0; i < opt.count; i++) {
+        replay.reset();
+        replay.playAnsi(data.data(), data.size(), opt.frame_bytes);
+    }
+
+    const Replay::Stats& st = replay.stats();
+    fprintf(stderr, "%s: %zu frames in %.3f s, %.0f fps, in %.1f MB/s, out %.1f MB/s\n", path,
+            st.frames, st.elapsed_ns / 1e9, st.fps(), st.inputRate() / 1e6, st.outputRate() / 1e6);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    options opt;
+    int c, ret = 0;
+
+    while ((c = getopt(argc, argv, "ab:c:s:n:t:h")) != -1) {
+        switch (c) {
+        case 'a':
+            opt.ansi = true;
+            break;
+        case 'b':
+            opt.frame_bytes = strtoul(optarg, nullptr, 0);
+            break;
+        case 'c':
+            opt.caps = strtoul(optarg, nullptr, 16);
+            break;
+        case 's':
+            if (sscanf(optarg, "%zux%zu", &opt.width, &opt.height) != 2 || !opt.width || !opt.height) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            opt.count = strtoul(optarg, nullptr, 0);
+            break;
+        case 't':
+            opt.speed = strtod(optarg, nullptr);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        int err = play(argv[i], opt);
+
+        if (err) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(-err));
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,351 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * conthrottle - renders into a pipe that is read slowly, like a terminal over a
+ * congested link, and reports how non-blocking output merged and dropped frames
+ * and how adaptive quality degraded and restored the output.
+ * The output is played back through the emulator at the end to check that the
+ * last frame arrived intact.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+/* Statistics are printed this often. */
+#define REPORT_INTERVAL_MS 500
+
+/* Pipe buffer size. Small like the buffer of a pty rather than the 64 KiB default. */
+#define PIPE_SIZE 4096
+
+/* Longest wait for adaptive quality to restore full quality at the end. */
+#define SETTLE_MS 15000
+
+struct options {
+    size_t read_bytes = 512;
+    unsigned read_interval_ms = 10;
+    unsigned fps = 60;
+    unsigned rects = 20;
+    unsigned seconds = 5;
+    unsigned fast_after = 0;
+    unsigned latency_ms = 0;
+    bool priority = false;
+    size_t width = 80;
+    size_t height = 24;
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -r bytes   Bytes the reader takes at a time. Default: 512.\n"
+            "  -i ms      Interval between reads. Default: 10.\n"
+            "  -f fps     Renders per second. Default: 60.\n"
+            "  -d rects   Random rects filled per render. Default: 20.\n"
+            "  -t seconds Time to render for. Default: 5.\n"
+            "  -u seconds Stop throttling the reader after seconds. Default: never.\n"
+            "  -a ms      Enable adaptive quality with this latency target.\n"
+            "  -p         Mark the frame counter as a priority layer.\n"
+            "  -s WxH     Screen size. Default: 80x24.\n",
+            name);
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Reads the pipe at a limited rate until the writer closes it. */
+static void reader(int fd, const options& opt, string& out, atomic<size_t>& taken)
+{
+    int64_t fast = opt.fast_after ? now_ms() + opt.fast_after * 1000 : INT64_MAX;
+    string buf(65536, 0);
+    bool throttled;
+    ssize_t sz;
+
+    do {
+        throttled = now_ms() < fast;
+        sz = read(fd, &buf[0], throttled ? min(opt.read_bytes, buf.size()) : buf.size());
+
+        if (sz > 0) {
+            out.append(buf.data(), sz);
+            taken += sz;
+        }
+        if (throttled)
+            usleep(opt.read_interval_ms * 1000);
+    } while (sz > 0 || (sz < 0 && errno == EINTR));
+}
+
+/* Fills random rects of the background and updates the frame counter. */
+static void scribble(Surface& bg, Surface& status, unsigned rects, unsigned frame)
+{
+    char text[32];
+
+    for (unsigned i = 0; i < rects; i++) {
+        size_t x = rand() % bg.width(), y = rand() % bg.height();
+        size_t w = 1 + rand() % 30, h = 1 + rand() % 3;
+
+        bg.fill(Char('a' + rand() % 26, rand() % 256, rand() % 256), Rect(x, y, x + w, y + h));
+    }
+
+    snprintf(text, sizeof(text), " frame %6u ", frame);
+    for (size_t x = 0; x < status.width() && text[x]; x++)
+        status.data()[x] = Char(text[x], Attribute::white, Attribute::blue);
+    status.invalidate();
+}
+
+static void report(Screen *sc, const options& opt, int64_t elapsed, unsigned renders, size_t taken)
+{
+    Screen::BackpressureStats bp = sc->backpressureStats();
+    const Screen::AdaptiveStats& as = sc->adaptiveStats();
+
+    printf("%6.1f s renders %6u merged %6zu dropped %6zu stalls %6zu read %8zu bytes\n",
+           elapsed / 1e3, renders, bp.merged, bp.dropped, bp.stalls, taken);
+
+    if (opt.latency_ms)
+        printf("         level %u fps %2u colors %3u backlog %6.0f ms degrades %3zu restores %3zu held %5zu\n",
+               as.level, as.fps, as.colors, as.backlog_ms, as.degrades, as.restores, as.held);
+}
+
+/* @return Number of cells the played back output differs in from the composited layers. */
+static int verify(const char *output, size_t len, Surface& bg, Surface& status, const Point& status_pos)
+{
+    unique_ptr<Screen> sc = Screen::createHeadless(bg.width(), bg.height());
+    Surface expected(bg.width(), bg.height());
+    FramebufferReader fb;
+    uint64_t seq;
+    int fd, ret, bad = 0;
+
+    if (!sc)
+        return -ENOMEM;
+
+    fd = sc->exportFramebuffer();
+    if (fd < 0)
+        return fd;
+
+    ret = fb.open(fd);
+    close(fd);
+    if (ret)
+        return ret;
+
+    Replay replay(sc.get());
+    replay.playAnsi(output, len);
+
+    expected.blend(bg, Rect(0, 0, bg.width(), bg.height()), Point(0, 0));
+    expected.blend(status, Rect(0, 0, status.width(), status.height()), status_pos);
+
+    ret = fb.begin(seq);
+    if (ret)
+        return ret;
+
+    for (size_t i = 0; i < fb.width() * fb.height(); i++)
+        bad += fb.data()[i] != expected.data()[i];
+
+    return bad;
+}
+
+static int run(const options& opt)
+{
+    Surface bg(opt.width, opt.height), status(14, 1);
+    const Point status_pos(1, 0);
+    int64_t start, now, next_render, next_report;
+    atomic<size_t> taken(0);
+    unsigned renders = 0;
+    string output;
+    bool degraded;
+    size_t len;
+    int pfd[2], queued, ret;
+
+    if (pipe2(pfd, O_CLOEXEC))
+        return -errno;
+    fcntl(pfd[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+    unique_ptr<Screen> sc = Screen::createHeadless(opt.width, opt.height, pfd[1]);
+    if (!sc || sc->setNonBlocking(true)) {
+        close(pfd[0]);
+        close(pfd[1]);
+        return -EINVAL;
+    }
+
+    sc->addLayer(&bg);
+    sc->addLayer(&status, status_pos, 1);
+
+    if (opt.priority)
+        sc->setLayerPriority(&status);
+
+    if (opt.latency_ms && (ret = sc->setAdaptive(opt.latency_ms))) {
+        close(pfd[0]);
+        close(pfd[1]);
+        return ret;
+    }
+
+    thread slow_reader(reader, pfd[0], cref(opt), ref(output), ref(taken));
+
+    start = now = now_ms();
+    next_render = next_report = start;
+    ret = 0;
+
+    while (!ret && now - start < opt.seconds * 1000) {
+        struct pollfd p = { pfd[1], POLLOUT, 0 };
+        int timeout;
+
+        if (now >= next_render) {
+            scribble(bg, status, opt.rects, renders);
+            bg.render();
+            renders++;
+            next_render += 1000 / opt.fps;
+        }
+
+        if (now >= next_report) {
+            report(sc.get(), opt, now - start, renders, taken);
+            next_report += REPORT_INTERVAL_MS;
+        }
+
+        timeout = max(next_render - now_ms(), (int64_t)0);
+        if (sc->frameTimeout() >= 0)
+            timeout = min(timeout, sc->frameTimeout());
+
+        poll(&p, sc->pending() ? 1 : 0, timeout);
+
+        ret = sc->flushPending();
+        if (ret == -EAGAIN)
+            ret = 0;
+        now = now_ms();
+    }
+
+    /* Let the reader take the rest and adaptive quality come back to full. */
+    while (!ret && (sc->pending() || sc->adaptiveStats().level != Screen::ADAPT_FULL) &&
+           now - start < opt.seconds * 1000 + SETTLE_MS) {
+        struct pollfd p = { pfd[1], POLLOUT, 0 };
+        int timeout = sc->frameTimeout();
+
+        poll(&p, sc->pending() ? 1 : 0, timeout < 0 || timeout > 50 ? 50 : timeout);
+
+        ret = sc->flushPending();
+        if (ret == -EAGAIN)
+            ret = 0;
+        now = now_ms();
+    }
+
+    /* The screen clears the terminal when destroyed. Check what was there before. */
+    while (!ioctl(pfd[1], FIONREAD, &queued) && queued > 0)
+        usleep(opt.read_interval_ms * 1000);
+    len = taken;
+
+    report(sc.get(), opt, now_ms() - start, renders, len);
+
+    degraded = sc->adaptiveStats().level != Screen::ADAPT_FULL;
+
+    sc.reset();
+    close(pfd[1]);
+    slow_reader.join();
+    close(pfd[0]);
+
+    if (ret)
+        return ret;
+
+    if (degraded) {
+        printf("%zu bytes of output, quality still degraded, not checked\n", len);
+        return 0;
+    }
+
+    ret = verify(output.data(), len, bg, status, status_pos);
+    if (ret < 0)
+        return ret;
+
+    printf("%zu bytes of output, %d cells differ from the last frame\n", len, ret);
+    return ret ? -EPROTO : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    options opt;
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "r:i:f:d:t:u:a:ps:h")) != -1) {
+        switch (c) {
+        case 'r':
+            opt.read_bytes = strtoul(optarg, nullptr, 0);
+            break;
+        case 'i':
+            opt.read_interval_ms = strtoul(optarg, nullptr, 0);
+            break;
+        case 'f':
+            opt.fps = strtoul(optarg, nullptr, 0);
+            break;
+        case 'd':
+            opt.rects = strtoul(optarg, nullptr, 0);
+            break;
+        case 't':
+            opt.seconds = strtoul(optarg, nullptr, 0);
+            break;
+        case 'u':
+            opt.fast_after = strtoul(optarg, nullptr, 0);
+            break;
+        case 'a':
+            opt.latency_ms = strtoul(optarg, nullptr, 0);
+            break;
+        case 'p':
+            opt.priority = true;
+            break;
+        case 's':
+            if (sscanf(optarg, "%zux%zu", &opt.width, &opt.height) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!opt.read_bytes || !opt.fps || opt.fps > 1000 || opt.width < 16 || !opt.height) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ret = run(opt);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(-ret));
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * conview - shows the frames of a StreamServer listening on a Unix domain socket
+ * on this terminal. Press q to quit.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+static int view(const char *path, StreamClient::Stats& stats)
+{
+    Screen *sc = Screen::getInstance();
+    Keyboard *kb = Keyboard::getInstance();
+    int ret;
+
+    if (!sc || !kb)
+        return -ENODEV;
+
+    StreamClient client(sc);
+
+    ret = client.connect(path);
+    if (ret)
+        return ret;
+
+    while (true) {
+        struct pollfd fds[2] = {
+            { client.fd(), POLLIN, 0 },
+            { kb->fd(), POLLIN, 0 },
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        if (fds[1].revents) {
+            int key = kb->waitForKey(0);
+
+            if (key == 'q' || key == Keyboard::KEY_ESC)
+                break;
+        }
+
+        if (fds[0].revents) {
+            ret = client.process();
+            if (ret == -EPIPE)
+                break;
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    stats = client.stats();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    StreamClient::Stats stats;
+    int ret;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s socket\n", argv[0]);
+        return 1;
+    }
+
+    ret = view(argv[1], stats);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(-ret));
+        return 1;
+    }
+
+    fprintf(stderr, "%s: %zu frames, %zu keyframes, %zu bytes, %zu renders\n", argv[1],
+            stats.frames, stats.keyframes, stats.bytes, stats.renders);
+    return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * libconutils
+ *
+ * Copyright (C) 2018 Vladislav Levenetz <octal.s@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * conwritebench - writes frames to N local ptys with blocking write(), with
+ * the AsyncWriter poll() fallback and with io_uring, and reports frames per
+ * second and system calls per frame of each.
+ */
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include "conutils.h"
+
+using namespace std;
+using namespace conutils;
+
+enum mode {
+    MODE_BLOCKING,
+    MODE_POLL,
+    MODE_IO_URING,
+};
+
+static const char *mode_names[] = { "blocking", "poll", "io_uring" };
+
+struct options {
+    unsigned ptys = 16;
+    unsigned frames = 200;
+    size_t frame_bytes = 4096;
+    unsigned entries = 256;
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [blocking|poll|io_uring]...\n"
+            "  -n ptys     Number of ptys written to. Default: 16.\n"
+            "  -f frames   Frames written to every pty. Default: 200.\n"
+            "  -b bytes    Size of a frame. Default: 4096.\n"
+            "  -e entries  Submission queue entries of the writer. Default: 256.\n"
+            "Runs all modes if none is given.\n",
+            name);
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Opens a raw pty pair. Frames go to the slave, the master is drained. */
+static int open_pty(int& master, int& slave)
+{
+    struct termios tio;
+    char name[64];
+
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0)
+        return -errno;
+
+    if (grantpt(master) || unlockpt(master) || ptsname_r(master, name, sizeof(name))) {
+        close(master);
+        return -errno;
+    }
+
+    slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (slave < 0) {
+        close(master);
+        return -errno;
+    }
+
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    return 0;
+}
+
+/* Reads everything the ptys get from one thread, like a terminal multiplexer would. */
+static void drain(const vector<int>& masters, const atomic<bool>& stop)
+{
+    vector<struct pollfd> fds;
+    char buf[65536];
+
+    for (int fd : masters)
+        fds.push_back({ fd, POLLIN, 0 });
+
+    while (!stop) {
+        if (poll(fds.data(), fds.size(), 10) <= 0)
+            continue;
+
+        for (auto& p : fds) {
+            if (p.revents & POLLIN && read(p.fd, buf, sizeof(buf)) < 0 && errno != EAGAIN)
+                return;
+        }
+    }
+}
+
+static int write_blocking(const vector<int>& slaves, const string& frame, unsigned frames, size_t& syscalls)
+{
+    for (unsigned f = 0; f < frames; f++) {
+        for (int fd : slaves) {
+            size_t done = 0;
+
+            while (done < frame.size()) {
+                ssize_t sz = write(fd, frame.data() + done, frame.size() - done);
+
+                syscalls++;
+                if (sz < 0 && errno != EINTR)
+                    return -errno;
+                if (sz > 0)
+                    done += sz;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int write_async(const vector<int>& slaves, const string& frame, const options& opt, bool io_uring,
+                       size_t& syscalls)
+{
+    AsyncWriter writer(opt.entries, io_uring);
+    vector<unsigned> left(slaves.size(), opt.frames);
+    function<void(size_t)> next;
+    int ret = 0;
+
+    if (io_uring && !writer.ioUring())
+        return -ENOSYS;
+
+    for (int fd : slaves) {
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+            return -errno;
+    }
+
+    /* One frame in flight per pty, the next one is queued when it completes. */
+    next = [&](size_t i) {
+        if (!left[i])
+            return;
+
+        left[i]--;
+        writer.write(slaves[i], frame.data(), frame.size(), [&, i](ssize_t result) {
+            if (result < 0)
+                ret = result;
+            else
+                next(i);
+        });
+    };
+
+    for (size_t i = 0; i < slaves.size(); i++)
+        next(i);
+
+    while (!ret && writer.inFlight()) {
+        int err = writer.process(-1);
+
+        if (err < 0)
+            ret = err;
+    }
+
+    syscalls = writer.stats().syscalls;
+    return ret;
+}
+
+static int run(mode m, const options& opt)
+{
+    vector<int> masters(opt.ptys, -1), slaves(opt.ptys, -1);
+    string frame(opt.frame_bytes, 'x');
+    atomic<bool> stop(false);
+    size_t syscalls = 0;
+    int64_t start, elapsed = 0;
+    int ret = 0;
+
+    for (unsigned i = 0; i < opt.ptys && !ret; i++)
+        ret = open_pty(masters[i], slaves[i]);
+
+    if (!ret) {
+        thread reader(drain, cref(masters), cref(stop));
+
+        start = now_ns();
+        if (m == MODE_BLOCKING)
+            ret = write_blocking(slaves, frame, opt.frames, syscalls);
+        else
+            ret = write_async(slaves, frame, opt, m == MODE_IO_URING, syscalls);
+        elapsed = now_ns() - start;
+
+        stop = true;
+        reader.join();
+    }
+
+    for (unsigned i = 0; i < opt.ptys; i++) {
+        if (slaves[i] >= 0)
+            close(slaves[i]);
+        if (masters[i] >= 0)
+            close(masters[i]);
+    }
+
+    if (ret)
+        return ret;
+
+    double total = (double)opt.ptys * opt.frames;
+
+    printf("N=%-5u %-8s %8.0f frames/s %8.1f MB/s %5.2f syscalls/frame\n", opt.ptys, mode_names[m],
+           total * 1e9 / elapsed, total * opt.frame_bytes * 1e3 / elapsed, syscalls / total);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    vector<mode> modes;
+    options opt;
+    int c, ret = 0;
+
+    while ((c = getopt(argc, argv, "n:f:b:e:h")) != -1) {
+        switch (c) {
+        case 'n':
+            opt.ptys = strtoul(optarg, nullptr, 0);
+            break;
+        case 'f':
+            opt.frames = strtoul(optarg, nullptr, 0);
+            break;
+        case 'b':
+            opt.frame_bytes = strtoul(optarg, nullptr, 0);
+            break;
+        case 'e':
+            opt.entries = strtoul(optarg, nullptr, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!opt.ptys || !opt.frames || !opt.frame_bytes || !opt.entries) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        size_t m;
+
+        for (m = MODE_BLOCKING; m <= MODE_IO_URING; m++) {
+            if (!strcmp(argv[i], mode_names[m]))
+                break;
+        }
+
+        if (m > MODE_IO_URING) {
+            usage(argv[0]);
+            return 1;
+        }
+        modes.push_back((mode)m);
+    }
+
+    if (modes.empty())
+        modes = { MODE_BLOCKING, MODE_POLL, MODE_IO_URING };
+
+    for (mode m : modes) {
+        int err = run(m, opt);
+
+        if (err) {
+            fprintf(stderr, "%s: %s\n", mode_names[m], strerror(-err));
+            ret = 1;
+        }
+    }
+
+    return ret;
+}